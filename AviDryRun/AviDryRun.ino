@@ -95,10 +95,13 @@ void setup()
   }
   else
   {
+    unsigned long open_ms = millis();
     a = AVI_open_input_file(avi_filename, 1);
+    open_ms = millis() - open_ms;
 
     if (a)
     {
+      Serial.printf("AVI_open_input_file: %lu ms, idx1 entries: %ld (%0.0f entries/s)\n", open_ms, a->n_idx, 1000.0 * a->n_idx / max(open_ms, 1UL));
       frames = AVI_video_frames(a);
       w = AVI_video_width(a);
       h = AVI_video_height(a);
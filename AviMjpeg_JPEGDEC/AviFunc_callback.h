@@ -1,5 +1,7 @@
 // #define AVI_SUPPORT_CINEPAK
 #define AVI_SUPPORT_MJPEG
+// #define AVI_MCU_PING_PONG // draw MCU rows on the other core while JPEGDEC decodes the next rows into the other half of its pixel buffer
+// #define AVI_MJPEG_ADAPTIVE_SCALE // decode MJPEG at 1/2, 1/4 or 1/8 (DC only) size while frames are predicted to miss their deadline, blown back up to full size on output
 // #define AVI_SUPPORT_AUDIO
 
 extern "C"
@@ -36,6 +38,19 @@ JPEGDEC jpegdec;
 int drawMCU(JPEGDRAW *pDraw);
 #endif // AVI_SUPPORT_MJPEG
 
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MCU_PING_PONG)
+#ifndef JPEG_USES_DMA
+#error "AVI_MCU_PING_PONG needs a JPEGDEC version with the JPEG_USES_DMA option"
+#endif
+#endif // AVI_SUPPORT_MJPEG && AVI_MCU_PING_PONG
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_ADAPTIVE_SCALE)
+#ifndef AVI_MJPEG_MAX_SHIFT
+#define AVI_MJPEG_MAX_SHIFT 3 // smallest decode size 1 / (1 << AVI_MJPEG_MAX_SHIFT), 3 (1/8) at most
+#endif
+#define AVI_MJPEG_HEADROOM_FRAMES 15 // frames in a row with headroom before trying a larger decode size
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_ADAPTIVE_SCALE
+
 /* variables */
 avi_t *avi;
 long avi_total_frames, estimateBufferSize, avi_aRate, avi_aBytes, avi_aChunks, actual_video_size;
@@ -52,6 +67,24 @@ unsigned long avi_total_read_video_ms;
 unsigned long avi_total_decode_video_ms;
 unsigned long avi_total_show_video_ms;
 
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MCU_PING_PONG)
+JPEGDRAW avi_mcu_draw;     // MCU rows the draw task sends
+bool avi_mcu_draw_pending; // queued, the draw not finished yet
+TaskHandle_t avi_mcu_task_handle;
+TaskHandle_t avi_mcu_caller_task;
+unsigned long avi_mcu_draws, avi_mcu_wait_ms; // time JPEGDEC still waits for the display bus
+bool avi_mcu_task_start();
+#endif // AVI_SUPPORT_MJPEG && AVI_MCU_PING_PONG
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_ADAPTIVE_SCALE)
+int avi_mjpeg_shift;                                      // current decode size 1 / (1 << avi_mjpeg_shift)
+unsigned long avi_mjpeg_scale_ms[AVI_MJPEG_MAX_SHIFT + 1]; // average frame decode time at each size, 0 if unknown
+long avi_mjpeg_scale_frames[AVI_MJPEG_MAX_SHIFT + 1];      // frames decoded at each size
+int avi_mjpeg_headroom_frames;
+uint16_t *avi_mjpeg_scale_buf; // one decoded row blown up to (1 << avi_mjpeg_shift) output rows
+long avi_mjpeg_scale_buf_w;
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_ADAPTIVE_SCALE
+
 #ifdef AVI_SUPPORT_AUDIO
 char *audbuf;
 size_t audbuf_read;
@@ -80,6 +113,13 @@ bool avi_init()
   }
 #endif // AVI_SUPPORT_AUDIO
 
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MCU_PING_PONG)
+  if (!avi_mcu_task_start())
+  {
+    return false;
+  }
+#endif // AVI_SUPPORT_MJPEG && AVI_MCU_PING_PONG
+
   return true;
 }
 
@@ -127,6 +167,22 @@ bool avi_open(char *avi_filename)
   avi_aRate = AVI_audio_rate(avi);
   avi_aBytes = AVI_audio_bytes(avi);
   avi_aChunks = AVI_audio_chunks(avi);
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_ADAPTIVE_SCALE)
+  if (((avi_w + 15) & ~15) > avi_mjpeg_scale_buf_w)
+  {
+    free(avi_mjpeg_scale_buf);
+    avi_mjpeg_scale_buf_w = (avi_w + 15) & ~15; // JPEGDEC pads the rows to whole MCUs
+    avi_mjpeg_scale_buf = (uint16_t *)heap_caps_malloc(avi_mjpeg_scale_buf_w * (1 << AVI_MJPEG_MAX_SHIFT) * 2, MALLOC_CAP_8BIT);
+    if (!avi_mjpeg_scale_buf)
+    {
+      Serial.println("avi_mjpeg_scale_buf heap_caps_malloc failed!");
+      avi_mjpeg_scale_buf_w = 0;
+      AVI_close(avi);
+      return false;
+    }
+  }
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_ADAPTIVE_SCALE
+
   Serial.printf("Audio channels: %ld, bits: %ld, format: %ld, rate: %ld, bytes: %ld, chunks: %ld\n", avi_aChans, avi_aBits, avi_aFormat, avi_aRate, avi_aBytes, avi_aChunks);
 
   avi_curr_frame = 0;
@@ -135,6 +191,19 @@ bool avi_open(char *avi_filename)
   avi_total_read_video_ms = 0;
   avi_total_decode_video_ms = 0;
   avi_total_show_video_ms = 0;
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MCU_PING_PONG)
+  avi_mcu_draws = 0;
+  avi_mcu_wait_ms = 0;
+#endif // AVI_SUPPORT_MJPEG && AVI_MCU_PING_PONG
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_ADAPTIVE_SCALE)
+  avi_mjpeg_shift = 0;
+  for (int i = 0; i <= AVI_MJPEG_MAX_SHIFT; ++i)
+  {
+    avi_mjpeg_scale_ms[i] = 0;
+    avi_mjpeg_scale_frames[i] = 0;
+  }
+  avi_mjpeg_headroom_frames = 0;
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_ADAPTIVE_SCALE
 
 #ifdef AVI_SUPPORT_AUDIO
   audbuf_remain = 0;
@@ -159,6 +228,137 @@ void avi_feed_audio()
 }
 #endif // AVI_SUPPORT_AUDIO
 
+#ifdef AVI_SUPPORT_MJPEG
+#ifdef AVI_MJPEG_ADAPTIVE_SCALE
+// blow the scaled down MCU rows up to full size, one decoded row at a time
+void avi_mjpeg_upscale(JPEGDRAW *pDraw)
+{
+  int n = 1 << avi_mjpeg_shift;
+  long w = min((long)pDraw->iWidth << avi_mjpeg_shift, avi_mjpeg_scale_buf_w);
+  uint16_t *src = pDraw->pPixels;
+  for (int j = 0; j < pDraw->iHeight; ++j)
+  {
+    for (long i = 0; i < w; ++i)
+    {
+      avi_mjpeg_scale_buf[i] = src[i >> avi_mjpeg_shift];
+    }
+    for (int k = 1; k < n; ++k)
+    {
+      memcpy(avi_mjpeg_scale_buf + (k * w), avi_mjpeg_scale_buf, w * 2);
+    }
+    gfx->draw16bitBeRGBBitmap(pDraw->x << avi_mjpeg_shift, (pDraw->y + j) << avi_mjpeg_shift, avi_mjpeg_scale_buf, w, n);
+    src += pDraw->iWidth;
+  }
+}
+
+// pick the decode size for the coming frame: one step down when the current size is
+// predicted to miss the frame deadline, one step up after a run of frames with headroom
+void avi_mjpeg_pick_scale()
+{
+  long budget_ms = (long)(avi_next_frame_ms - millis());
+  if ((avi_mjpeg_shift < AVI_MJPEG_MAX_SHIFT) && ((long)avi_mjpeg_scale_ms[avi_mjpeg_shift] > budget_ms))
+  {
+    ++avi_mjpeg_shift;
+    avi_mjpeg_headroom_frames = 0;
+  }
+  else if ((avi_mjpeg_shift > 0) && ((long)avi_mjpeg_scale_ms[avi_mjpeg_shift] * 2 < budget_ms))
+  {
+    if (++avi_mjpeg_headroom_frames >= AVI_MJPEG_HEADROOM_FRAMES)
+    {
+      --avi_mjpeg_shift;
+      avi_mjpeg_scale_ms[avi_mjpeg_shift] = 0; // the old average may date from a heavier scene, measure again
+      avi_mjpeg_headroom_frames = 0;
+    }
+  }
+  else
+  {
+    avi_mjpeg_headroom_frames = 0;
+  }
+}
+
+void avi_mjpeg_scale_update(unsigned long decode_ms)
+{
+  unsigned long *avg = &avi_mjpeg_scale_ms[avi_mjpeg_shift];
+  *avg = (*avg == 0) ? decode_ms : ((*avg * 3) + decode_ms) / 4;
+  ++avi_mjpeg_scale_frames[avi_mjpeg_shift];
+}
+#endif // AVI_MJPEG_ADAPTIVE_SCALE
+
+// draw the MCU rows JPEGDEC decoded
+void avi_mcu_show(JPEGDRAW *pDraw)
+{
+#ifdef AVI_MJPEG_ADAPTIVE_SCALE
+  if (avi_mjpeg_shift)
+  {
+    avi_mjpeg_upscale(pDraw);
+    return;
+  }
+#endif // AVI_MJPEG_ADAPTIVE_SCALE
+  gfx->draw16bitBeRGBBitmap(pDraw->x, pDraw->y, pDraw->pPixels, pDraw->iWidth, pDraw->iHeight);
+}
+#endif // AVI_SUPPORT_MJPEG
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MCU_PING_PONG)
+// send the queued MCU rows on the other core, JPEGDEC meanwhile fills the other buffer half
+void avi_mcu_task(void *pvParam)
+{
+  while (1)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    unsigned long curr_ms = millis();
+    avi_mcu_show(&avi_mcu_draw);
+    avi_total_show_video_ms += millis() - curr_ms;
+    xTaskNotifyGive(avi_mcu_caller_task);
+  }
+}
+
+bool avi_mcu_task_start()
+{
+  avi_mcu_draw_pending = false;
+
+  BaseType_t ret_val = xTaskCreatePinnedToCore(
+      (TaskFunction_t)avi_mcu_task,
+      (const char *const)"AVI MCU Task",
+      (const uint32_t)4096,
+      (void *const)NULL,
+      (UBaseType_t)configMAX_PRIORITIES - 3,
+      (TaskHandle_t *const)&avi_mcu_task_handle,
+      (const BaseType_t)0);
+  if (ret_val != pdPASS)
+  {
+    Serial.printf("avi_mcu_task start failed: %d\n", ret_val);
+    return false;
+  }
+  return true;
+}
+
+// wait for the queued MCU rows, returns false if none
+bool avi_mcu_wait()
+{
+  if (!avi_mcu_draw_pending)
+  {
+    return false;
+  }
+  unsigned long curr_ms = millis();
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  avi_mcu_wait_ms += millis() - curr_ms;
+  avi_mcu_draw_pending = false;
+  return true;
+}
+
+// call from drawMCU, returns as soon as the draw task takes the rows;
+// the previous rows must be out before JPEGDEC reuses their buffer half
+void avi_mcu_queue(JPEGDRAW *pDraw)
+{
+  avi_mcu_wait();
+  avi_mcu_draw = *pDraw;
+  avi_mcu_caller_task = xTaskGetCurrentTaskHandle();
+  avi_mcu_draw_pending = true;
+  ++avi_mcu_draws;
+  xTaskNotifyGive(avi_mcu_task_handle);
+}
+#endif // AVI_SUPPORT_MJPEG && AVI_MCU_PING_PONG
+
 bool avi_decode()
 {
   avi_next_frame_ms = avi_start_ms + ((avi_curr_frame + 1) * 1000 / avi_fr);
@@ -207,10 +407,30 @@ bool avi_decode()
 #ifdef AVI_SUPPORT_MJPEG
       else if (avi_vcodec == MJPEG_CODEC_CODE)
       {
+        int options = 0;
+#ifdef AVI_MJPEG_ADAPTIVE_SCALE
+        avi_mjpeg_pick_scale();
+        if (avi_mjpeg_shift)
+        {
+          options |= JPEG_SCALE_HALF << (avi_mjpeg_shift - 1); // JPEG_SCALE_HALF, JPEG_SCALE_QUARTER, JPEG_SCALE_EIGHTH
+        }
+        unsigned long frame_ms = millis();
+#endif // AVI_MJPEG_ADAPTIVE_SCALE
         jpegdec.openRAM((uint8_t *)vidbuf, actual_video_size, drawMCU);
         jpegdec.setPixelType(RGB565_BIG_ENDIAN);
-        jpegdec.decode(0, 0, 0);
+#ifdef AVI_MCU_PING_PONG
+        unsigned long wait_ms = avi_mcu_wait_ms;
+        jpegdec.decode(0, 0, options | JPEG_USES_DMA);
         jpegdec.close();
+        avi_mcu_wait(); // the last rows
+        curr_ms += avi_mcu_wait_ms - wait_ms; // the bus waits count as show time
+#else
+        jpegdec.decode(0, 0, options);
+        jpegdec.close();
+#endif
+#ifdef AVI_MJPEG_ADAPTIVE_SCALE
+        avi_mjpeg_scale_update(millis() - frame_ms);
+#endif // AVI_MJPEG_ADAPTIVE_SCALE
       }
 #endif // AVI_SUPPORT_MJPEG
       avi_total_decode_video_ms += millis() - curr_ms;
@@ -251,6 +471,17 @@ void avi_show_stat()
   Serial.printf("Read video: %lu ms (%0.1f %%)\n", avi_total_read_video_ms, 100.0 * avi_total_read_video_ms / time_used);
   Serial.printf("Decode video: %lu ms (%0.1f %%)\n", avi_total_decode_video_ms, 100.0 * avi_total_decode_video_ms / time_used);
   Serial.printf("Show video: %lu ms (%0.1f %%)\n", avi_total_show_video_ms, 100.0 * avi_total_show_video_ms / time_used);
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MCU_PING_PONG)
+  Serial.printf("MCU ping-pong: %lu draws, JPEGDEC waited %lu ms of the %lu ms show\n", avi_mcu_draws, avi_mcu_wait_ms, avi_total_show_video_ms);
+#endif // AVI_SUPPORT_MJPEG && AVI_MCU_PING_PONG
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_ADAPTIVE_SCALE)
+  Serial.printf("Adaptive scale: full %ld", avi_mjpeg_scale_frames[0]);
+  for (int i = 1; i <= AVI_MJPEG_MAX_SHIFT; ++i)
+  {
+    Serial.printf(", 1/%d %ld", 1 << i, avi_mjpeg_scale_frames[i]);
+  }
+  Serial.println(" frames");
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_ADAPTIVE_SCALE
 #ifdef AVI_SUPPORT_AUDIO
   Serial.printf("Read audio: %lu ms (%0.1f %%)\n", avi_total_read_audio_ms, 100.0 * avi_total_read_audio_ms / time_used);
   Serial.printf("Decode audio: %lu ms (%0.1f %%)\n", total_decode_audio_ms, 100.0 * total_decode_audio_ms / time_used);
@@ -21,14 +21,123 @@
  *
  */
 
-/* Below 2 parameters should define before include this header file */
-// #define BIG_ENDIAN_PIXEL
-// #define USE_DRAW_CALLBACK
+/* Below 5 parameters should define before include this header file */
+// #define BIG_ENDIAN_PIXEL // pixel format of CinepakDecoder, CinepakDecoderWithCodebooksT<> takes any format below
+// #define USE_DRAW_CALLBACK // output_buf holds one 4-row band, changed blocks are drawn in horizontal spans
+// #define CINEPAK_PARALLEL // decode the strips of a frame on both cores
+// #define CINEPAK_DIRTY_BLOCKS // track the changed blocks for partial display updates
+// #define CINEPAK_TRANSFORM // setTransform() scales and rotates the output while the blocks are written
+
+#include <type_traits>
+
+#ifdef CINEPAK_PARALLEL
+#ifdef USE_DRAW_CALLBACK
+#error "CINEPAK_PARALLEL decodes into output_buf, it cannot be used with USE_DRAW_CALLBACK"
+#endif
+#define CINEPAK_MAX_STRIPS 32
+#define CINEPAK_CODEBOOK_SETS 2 // the worker decodes on its own copy
+#else
+#define CINEPAK_CODEBOOK_SETS 1
+#endif
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+#ifdef USE_DRAW_CALLBACK
+#error "USE_DRAW_CALLBACK already draws the changed blocks only, CINEPAK_DIRTY_BLOCKS is not needed"
+#endif
+typedef struct
+{
+	uint16_t x, y, w, h;
+} CinepakRect;
+#endif
+
+#ifdef CINEPAK_TRANSFORM
+#ifdef USE_DRAW_CALLBACK
+#error "CINEPAK_TRANSFORM places the blocks in output_buf, it cannot be used with USE_DRAW_CALLBACK"
+#endif
+enum CinepakScale
+{
+	CINEPAK_SCALE_1,	// 4x4 blocks
+	CINEPAK_SCALE_2,	// 8x8 blocks, pixels doubled
+	CINEPAK_SCALE_HALF, // 2x2 blocks, V4 entries averaged
+};
+#endif
 
 #ifdef USE_DRAW_CALLBACK
 typedef void(DRAW_CALLBACK)(uint16_t x, uint16_t y, uint16_t *p, uint16_t w, uint16_t h);
 #endif
 
+/**
+ * Output pixel formats, the template parameter of CinepakDecoderT. The
+ * codebook colors are converted once when loaded, the block writes copy
+ * pixels of the final format. Packed formats convert through per-channel
+ * lookup tables.
+ */
+struct CinepakRGB565BE
+{
+	typedef uint16_t pixel_t;
+	static const bool packed = true; // rgb() ORs independent per-channel bits
+	static inline pixel_t rgb(uint8_t r, uint8_t g, uint8_t b)
+	{
+		return (((0xF8 & r)) | ((g) >> 5) | ((0x1C & g) << 11) | ((0xF8 & b) << 5));
+	}
+};
+
+struct CinepakRGB565LE
+{
+	typedef uint16_t pixel_t;
+	static const bool packed = true;
+	static inline pixel_t rgb(uint8_t r, uint8_t g, uint8_t b)
+	{
+		return (((0xF8 & r) << 8) | ((0xFC & g) << 3) | ((b) >> 3));
+	}
+};
+
+// 3 bytes in R, G, B order, as RGB and DSI panels and 18-bit SPI panels take
+typedef struct
+{
+	uint8_t r, g, b;
+} CinepakPixel24;
+
+struct CinepakRGB666
+{
+	typedef CinepakPixel24 pixel_t;
+	static const bool packed = false;
+	static inline pixel_t rgb(uint8_t r, uint8_t g, uint8_t b)
+	{
+		return {(uint8_t)(r & 0xFC), (uint8_t)(g & 0xFC), (uint8_t)(b & 0xFC)};
+	}
+};
+
+struct CinepakRGB888
+{
+	typedef CinepakPixel24 pixel_t;
+	static const bool packed = false;
+	static inline pixel_t rgb(uint8_t r, uint8_t g, uint8_t b)
+	{
+		return {r, g, b};
+	}
+};
+
+struct CinepakGray8
+{
+	typedef uint8_t pixel_t;
+	static const bool packed = false;
+	static inline pixel_t rgb(uint8_t r, uint8_t g, uint8_t b)
+	{
+		return ((r * 77) + (g * 150) + (b * 29)) >> 8;
+	}
+};
+
+struct CinepakRGB332
+{
+	typedef uint8_t pixel_t;
+	static const bool packed = true;
+	static inline pixel_t rgb(uint8_t r, uint8_t g, uint8_t b)
+	{
+		return (r & 0xE0) | ((g & 0xE0) >> 3) | (b >> 6);
+	}
+};
+
 /**
  * Cinepak decoder.
  *
@@ -36,40 +145,169 @@ typedef void(DRAW_CALLBACK)(uint16_t x, uint16_t y, uint16_t *p, uint16_t w, uin
  *
  * Used in engines:
  *  - sherlock
+ *
+ * The codebooks carried from frame to frame live in a caller-supplied
+ * codebooks_t (CINEPAK_CODEBOOK_SETS of them), the color tables are static
+ * and shared by every decoder of the same pixel format. Each decoder then
+ * only holds its frame state, so several streams can decode concurrently:
+ *
+ *   static CinepakPooledDecoder::codebooks_t pool[2][CINEPAK_CODEBOOK_SETS];
+ *   CinepakPooledDecoder main_video(pool[0]), pip_video(pool[1]);
  */
-class CinepakDecoder
+template <class PIXEL>
+class CinepakDecoderT
 {
 public:
-	CinepakDecoder()
+	typedef typename PIXEL::pixel_t pixel_t;
+#ifdef USE_DRAW_CALLBACK
+	typedef void(draw_callback_t)(uint16_t x, uint16_t y, pixel_t *p, uint16_t w, uint16_t h);
+#endif
+
+	// Codebook state of one stream
+	typedef struct
+	{
+		// V1 entries pre-expanded to the two distinct rows of their 4x4 block:
+		// c0 c0 c1 c1 for rows 0-1, c2 c2 c3 c3 for rows 2-3
+		pixel_t v1_tiles[256 * 8] __attribute__((aligned(4)));
+		pixel_t v4[1024];
+	} codebooks_t;
+
+	CinepakDecoderT(codebooks_t *codebooks)
 	{
 		_y = 0;
+		_codebooks = codebooks;
+		_v1_tiles = codebooks->v1_tiles;
+		_v4_codebook = codebooks->v4;
 
-		// Create a lookup for the clip function
-		// This dramatically improves the performance of the color conversion
-		_clipTableBuf = new uint8_t[1024];
+		if (!_tables_ready)
+		{
+			initTables();
+		}
+	}
 
-		for (uint i = 0; i < 1024; i++)
+	~CinepakDecoderT()
+	{
+#ifdef CINEPAK_PARALLEL
+		if (_worker)
 		{
-			if (i <= 512)
-				_clipTableBuf[i] = 0;
-			else if (i >= 768)
-				_clipTableBuf[i] = 255;
+			vTaskDelete(_worker_task);
+#ifdef CINEPAK_DIRTY_BLOCKS
+			_worker->_dirty = nullptr; // shared with this decoder
+#endif
+			delete _worker;
+		}
+#endif
+#ifdef CINEPAK_DIRTY_BLOCKS
+		delete[] _dirty;
+#endif
+	}
+
+#ifdef CINEPAK_PARALLEL
+	// Stack bytes the worker task has never used, 0 before the first
+	// multi-strip frame started it
+	uint32_t getWorkerStackFree()
+	{
+		return _worker ? uxTaskGetStackHighWaterMark(_worker_task) : 0;
+	}
+#endif
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+	// Changed regions since the last clearDirty(), the 4-row bands merged
+	// into rectangles while their x ranges overlap. Returns the count.
+	uint16_t getDirtyRects(CinepakRect *rects, uint16_t max_rects)
+	{
+		uint16_t width = _width;
+		uint16_t height = _height;
+#ifdef CINEPAK_TRANSFORM
+		if (_transform)
+		{
+			// the transformed output covers whole blocks
+			width = (_width + 3) & ~3;
+			height = (_height + 3) & ~3;
+		}
+#endif
+		uint16_t bands = (height + 3) >> 2; // _dirty may hold the bands of a taller frame before
+		if (bands > _dirty_bands)
+			bands = _dirty_bands;
+		uint16_t n = 0;
+		for (uint16_t b = 0; b < bands; b++)
+		{
+			uint16_t x0 = _dirty[b << 1];
+			uint16_t x1 = (_dirty[(b << 1) + 1] < width) ? _dirty[(b << 1) + 1] : width;
+			if (x0 >= x1)
+				continue;
+
+			uint16_t y = b << 2;
+			uint16_t h = ((y + 4) < height) ? 4 : (height - y);
+			CinepakRect *r = rects + n - 1;
+			if ((n > 0) && ((((r->y + r->h) == y) && (x0 < (r->x + r->w)) && (r->x < x1)) || (n == max_rects)))
+			{
+				// adjacent and overlapping, or out of rectangles: grow the last one
+				uint16_t r_x1 = ((r->x + r->w) > x1) ? (r->x + r->w) : x1;
+				if (r->x > x0)
+					r->x = x0;
+				r->w = r_x1 - r->x;
+				r->h = y + h - r->y;
+			}
 			else
-				_clipTableBuf[i] = i - 512;
+			{
+				r = rects + n++;
+				r->x = x0;
+				r->y = y;
+				r->w = x1 - x0;
+				r->h = h;
+			}
 		}
+#ifdef CINEPAK_TRANSFORM
+		if (_transform)
+		{
+			for (uint16_t i = 0; i < n; i++)
+			{
+				transformRect(rects + i);
+			}
+		}
+#endif
+		return n;
+	}
 
-		_clipTable = _clipTableBuf + 512;
+	void clearDirty()
+	{
+		for (uint16_t b = 0; b < _dirty_bands; b++)
+		{
+			_dirty[b << 1] = 0xFFFF;
+			_dirty[(b << 1) + 1] = 0;
+		}
 	}
+#endif // CINEPAK_DIRTY_BLOCKS
 
-	~CinepakDecoder()
+#ifdef CINEPAK_TRANSFORM
+	// Scale and rotate the output while the blocks are written, rotation is
+	// clockwise in 90 degree steps. The codebooks are kept in the output
+	// orientation, so set it before the first frame of a stream.
+	void setTransform(CinepakScale scale, uint8_t rotation)
 	{
-		delete[] _clipTableBuf;
+		static const uint8_t quads[4][4] = {{0, 1, 2, 3}, {2, 0, 3, 1}, {3, 2, 1, 0}, {1, 3, 0, 2}};
+
+		_block_size = (scale == CINEPAK_SCALE_2) ? 8 : ((scale == CINEPAK_SCALE_HALF) ? 2 : 4);
+		_rotation = rotation & 3;
+		memcpy(_quad, quads[_rotation], 4);
+		_transform = (_block_size != 4) || _rotation;
 	}
 
+	// Output frame size of a width x height video, whole blocks
+	void getOutputSize(uint16_t *width, uint16_t *height)
+	{
+		uint16_t w = (((*width + 3) >> 2) * _block_size);
+		uint16_t h = (((*height + 3) >> 2) * _block_size);
+		*width = (_rotation & 1) ? h : w;
+		*height = (_rotation & 1) ? w : h;
+	}
+#endif // CINEPAK_TRANSFORM
+
 #ifdef USE_DRAW_CALLBACK
-	void decodeFrame(uint8_t *data, size_t data_size, uint16_t *output_buf, size_t output_buf_size, DRAW_CALLBACK *draw, bool iskeyframe)
+	void decodeFrame(uint8_t *data, size_t data_size, pixel_t *output_buf, size_t output_buf_size, draw_callback_t *draw, bool iskeyframe)
 #else
-	void decodeFrame(uint8_t *data, size_t data_size, uint16_t *output_buf, size_t output_buf_size)
+	void decodeFrame(uint8_t *data, size_t data_size, pixel_t *output_buf, size_t output_buf_size)
 #endif
 	{
 		_data = data;
@@ -82,6 +320,61 @@ public:
 		_iskeyframe = iskeyframe;
 #endif
 
+		readFrameHeader();
+		_rows_aligned = !(((uintptr_t)_output_buf) & 3) && !((_width * sizeof(pixel_t)) & 3);
+#ifdef CINEPAK_TRANSFORM
+		if (_transform)
+		{
+			initTransform();
+		}
+#endif
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+		if (((_height + 3) >> 2) > _dirty_bands)
+		{
+			delete[] _dirty;
+			_dirty_bands = (_height + 3) >> 2;
+			_dirty = new uint16_t[_dirty_bands << 1];
+		}
+		if ((_width != _dirty_width) || (_height != _dirty_height))
+		{
+			// the ranges of another frame size do not map to this one
+			_dirty_width = _width;
+			_dirty_height = _height;
+			clearDirty();
+		}
+#endif
+
+		_y = 0;
+
+#ifdef CINEPAK_PARALLEL
+		if (decodeStripsParallel())
+		{
+			return;
+		}
+#endif
+
+		for (uint16_t i = 0; i < _stripCount; i++)
+		{
+			if (!decodeStrip(STRIP_DECODE))
+			{
+				return;
+			}
+		}
+
+		return;
+	}
+
+private:
+	enum
+	{
+		STRIP_SKIP,		 // walk the chunks only
+		STRIP_CODEBOOKS, // load the codebooks, skip the vectors
+		STRIP_DECODE,
+	};
+
+	void readFrameHeader()
+	{
 		_flags = readUint8();
 		_length = readUint24BE();
 		_width = readUint16BE();
@@ -103,77 +396,200 @@ public:
 				_data_pos -= 2;
 			}
 		}
+	}
 
-		_y = 0;
-
-		for (uint16_t i = 0; i < _stripCount; i++)
-		{
-			_data_pos += 2;						 // Ignore, substitute with our own.
-			_strip_length = readUint16BE() - 12; // Subtract the 12 uint8_t header
-			_strip_top = _y;
-			_data_pos += 2; // Ignore, substitute with our own.
-			_data_pos += 2; // Ignore, substitute with our own.
-			_strip_height = readUint16BE();
-			_strip_bottom = _y + _strip_height;
-			_data_pos += 2; // Ignore, substitute with our own.
+	// Decode the strip at _data_pos, returns false on an unknown chunk
+	bool decodeStrip(uint8_t mode)
+	{
+		_data_pos += 1;						 // Ignore, substitute with our own.
+		_strip_length = readUint24BE() - 12; // Subtract the 12 uint8_t header
+		_strip_top = _y;
+		_data_pos += 2; // Ignore, substitute with our own.
+		_data_pos += 2; // Ignore, substitute with our own.
+		_strip_height = readUint16BE();
+		_strip_bottom = _y + _strip_height;
+		_data_pos += 2; // Ignore, substitute with our own.
 
-			uint32_t pos = _data_pos;
+		uint32_t pos = _data_pos;
 
-			while ((uint32_t)_data_pos < (pos + _strip_length) && (_data_pos < (_data_size - 1)))
-			{
-				uint8_t chunkID = readUint8();
+		while ((uint32_t)_data_pos < (pos + _strip_length) && (_data_pos < (_data_size - 1)))
+		{
+			uint8_t chunkID = readUint8();
 
-				if (_data_pos >= (_data_size - 1))
-					break;
+			if (_data_pos >= (_data_size - 1))
+				break;
 
-				// Chunk Size is 24-bit, ignore the first 4 bytes
-				uint32_t chunkSize = readUint24BE() - 4;
+			// Chunk Size is 24-bit, ignore the first 4 bytes
+			uint32_t chunkSize = readUint24BE() - 4;
 
-				int32_t startPos = _data_pos;
+			int32_t startPos = _data_pos;
 
-				switch (chunkID)
+			switch (chunkID)
+			{
+			case 0x20:
+			case 0x21:
+			case 0x24:
+			case 0x25:
+				if (mode != STRIP_SKIP)
+					loadCodebook<false>(chunkID, chunkSize);
+				break;
+			case 0x22:
+			case 0x23:
+			case 0x26:
+			case 0x27:
+				if (mode != STRIP_SKIP)
+					loadCodebook<true>(chunkID, chunkSize);
+				break;
+			case 0x30:
+			case 0x31:
+			case 0x32:
+				if (mode == STRIP_DECODE)
 				{
-				case 0x20:
-				case 0x21:
-				case 0x24:
-				case 0x25:
-					loadCodebook(_v4_codebook, chunkID, chunkSize);
-					break;
-				case 0x22:
-				case 0x23:
-				case 0x26:
-				case 0x27:
-					loadCodebook(_v1_codebook, chunkID, chunkSize);
-					break;
-				case 0x30:
-				case 0x31:
-				case 0x32:
 					decodeVectors(chunkID, chunkSize);
-					break;
-				default:
-					// Serial.printf("Unknown Cinepak chunk ID %02x\n", chunkID);
-					return;
+#ifdef USE_DRAW_CALLBACK
+					drawSpan(); // a short chunk can stop mid band
+#endif
 				}
+				break;
+			default:
+				// Serial.printf("Unknown Cinepak chunk ID %02x\n", chunkID);
+				return false;
+			}
+
+			if (_data_pos != startPos + (int32_t)chunkSize)
+				_data_pos = startPos + chunkSize;
+		}
+
+		_y = _strip_bottom;
+		return true;
+	}
 
-				if (_data_pos != startPos + (int32_t)chunkSize)
-					_data_pos = startPos + chunkSize;
+#ifdef CINEPAK_PARALLEL
+	CinepakDecoderT *_worker = nullptr;
+	TaskHandle_t _worker_task;
+	TaskHandle_t _caller_task;
+	uint16_t _worker_first_strip;
+
+	// Split the strips in two runs of about the same size. The worker task on
+	// the other core replays the codebook chunks of the first run on its own
+	// codebooks, then decodes the second run while this task decodes the first.
+	bool decodeStripsParallel()
+	{
+		if ((_stripCount < 2) || (_stripCount > CINEPAK_MAX_STRIPS))
+		{
+			return false;
+		}
+
+		// pre-scan the strip headers
+		size_t data_pos = _data_pos;
+		size_t strip_pos[CINEPAK_MAX_STRIPS + 1];
+		for (uint16_t i = 0; i < _stripCount; i++)
+		{
+			strip_pos[i] = _data_pos;
+			if (!decodeStrip(STRIP_SKIP))
+			{
+				_data_pos = data_pos;
+				_y = 0;
+				return false;
 			}
+		}
+		strip_pos[_stripCount] = _data_pos;
 
-			_y = _strip_bottom;
+		uint16_t split = 1;
+		while ((split < _stripCount - 1) && ((strip_pos[split] - strip_pos[0]) * 2 < (strip_pos[_stripCount] - strip_pos[0])))
+		{
+			++split;
 		}
 
-		return;
+		if (!_worker)
+		{
+			_worker = new CinepakDecoderT(_codebooks + 1);
+			if (xTaskCreatePinnedToCore(
+					(TaskFunction_t)workerTask,
+					(const char *const)"Cinepak Worker Task",
+					(const uint32_t)4096,
+					(void *const)_worker,
+					(UBaseType_t)configMAX_PRIORITIES - 3,
+					(TaskHandle_t *const)&_worker_task,
+					(const BaseType_t)0) != pdPASS)
+			{
+				delete _worker;
+				_worker = nullptr;
+			}
+		}
+		if (!_worker)
+		{
+			_data_pos = data_pos;
+			_y = 0;
+			return false;
+		}
+
+		_worker->_data = _data;
+		_worker->_data_size = _data_size;
+		_worker->_data_pos = data_pos;
+		_worker->_output_buf = _output_buf;
+		_worker->_width = _width;
+		_worker->_height = _height;
+		_worker->_rows_aligned = _rows_aligned;
+#ifdef CINEPAK_TRANSFORM
+		_worker->_transform = _transform;
+		_worker->_block_size = _block_size;
+		_worker->_rotation = _rotation;
+		memcpy(_worker->_quad, _quad, 4);
+		_worker->_scaled_width = _scaled_width;
+		_worker->_scaled_height = _scaled_height;
+		_worker->_out_stride = _out_stride;
+#endif
+		_worker->_stripCount = _stripCount;
+		_worker->_worker_first_strip = split;
+#ifdef CINEPAK_DIRTY_BLOCKS
+		_worker->_dirty = _dirty; // the strips cover disjoint bands
+		_worker->_dirty_bands = _dirty_bands;
+#endif
+		_worker->_caller_task = xTaskGetCurrentTaskHandle();
+		memcpy(_worker->_codebooks, _codebooks, sizeof(codebooks_t));
+		xTaskNotifyGive(_worker_task);
+
+		_data_pos = data_pos;
+		_y = 0;
+		for (uint16_t i = 0; i < split; i++)
+		{
+			decodeStrip(STRIP_DECODE);
+		}
+
+		// the codebooks after the last strip carry over to the next frame
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		memcpy(_codebooks, _worker->_codebooks, sizeof(codebooks_t));
+		return true;
 	}
 
-private:
+	static void workerTask(void *pvParam)
+	{
+		CinepakDecoderT *d = (CinepakDecoderT *)pvParam;
+		while (1)
+		{
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			d->_y = 0;
+			for (uint16_t i = 0; i < d->_stripCount; i++)
+			{
+				d->decodeStrip((i < d->_worker_first_strip) ? STRIP_CODEBOOKS : STRIP_DECODE);
+			}
+			xTaskNotifyGive(d->_caller_task);
+		}
+	}
+#endif // CINEPAK_PARALLEL
+
 	uint8_t *_data;
 	size_t _data_size;
 	size_t _data_pos;
-	uint16_t *_output_buf;
+	pixel_t *_output_buf;
 	size_t _output_buf_size;
 #ifdef USE_DRAW_CALLBACK
-	DRAW_CALLBACK *_draw;
+	draw_callback_t *_draw;
 	bool _iskeyframe;
+	int16_t _span_x0 = -1; // updated blocks waiting in the band, -1 if none
+	uint16_t _span_x1;
+	uint16_t _span_y;
 #endif
 
 	uint8_t _flags;
@@ -185,11 +601,71 @@ private:
 	int16_t _strip_top;
 	int16_t _strip_bottom;
 	int16_t _strip_height;
-	uint16_t _strip_length;
-	uint16_t _v1_codebook[1024], _v4_codebook[1024];
+	uint32_t _strip_length;
+	codebooks_t *_codebooks;
+	pixel_t *_v4_codebook;
+	pixel_t *_v1_tiles;
+	bool _rows_aligned; // output rows allow 32-bit aligned tile row copies
+
+#ifdef CINEPAK_TRANSFORM
+	bool _transform = false;
+	uint8_t _block_size = 4; // output size of a 4x4 block: 2, 4 or 8
+	uint8_t _rotation = 0;
+	uint8_t _quad[4] = {0, 1, 2, 3}; // source quadrant of each output quadrant
+	int32_t _scaled_width;			 // before the rotation
+	int32_t _scaled_height;
+	int32_t _out_stride;
+#endif
 
 	int32_t _y;
-	uint8_t *_clipTable, *_clipTableBuf;
+
+	// Shared by the decoders of this pixel format, built by the first one.
+	// Static arrays stay in internal RAM, not in PSRAM like big heap blocks.
+	static uint8_t _clipTableBuf[1024];
+	static pixel_t _rgbTableBuf[768 * 3];
+	static bool _tables_ready;
+
+	static void initTables()
+	{
+		// Create a lookup for the clip function
+		// This dramatically improves the performance of the color conversion
+		for (uint i = 0; i < 1024; i++)
+		{
+			if (i <= 512)
+				_clipTableBuf[i] = 0;
+			else if (i >= 768)
+				_clipTableBuf[i] = 255;
+			else
+				_clipTableBuf[i] = i - 512;
+		}
+
+		initTables(std::integral_constant<bool, PIXEL::packed>());
+		_tables_ready = true;
+	}
+
+	// Per-channel pixel bits of every clipped sum a codebook color can
+	// make, y + chroma in [-256, 511], so a packed pixel is 3 lookups
+	static void initTables(std::true_type)
+	{
+		for (int i = 0; i < 768; i++)
+		{
+			uint8_t c = _clipTableBuf[512 + i - 256];
+			_rgbTableBuf[i] = PIXEL::rgb(c, 0, 0);
+			_rgbTableBuf[768 + i] = PIXEL::rgb(0, c, 0);
+			_rgbTableBuf[1536 + i] = PIXEL::rgb(0, 0, c);
+		}
+	}
+
+	static void initTables(std::false_type)
+	{
+	}
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+	uint16_t *_dirty = nullptr; // x range [start, end) written in each 4-row band
+	uint16_t _dirty_bands = 0;
+	uint16_t _dirty_width = 0; // frame size the ranges are of
+	uint16_t _dirty_height = 0;
+#endif
 
 	inline uint8_t readUint8()
 	{
@@ -203,11 +679,11 @@ private:
 		return (a << 8) | b;
 	}
 
-	inline uint16_t readUint24BE()
+	inline uint32_t readUint24BE()
 	{
-		uint16_t a = _data[_data_pos++];
-		uint16_t b = _data[_data_pos++];
-		uint16_t c = _data[_data_pos++];
+		uint32_t a = _data[_data_pos++];
+		uint32_t b = _data[_data_pos++];
+		uint32_t c = _data[_data_pos++];
 		return (a << 16) | (b << 8) | c;
 	}
 
@@ -220,25 +696,37 @@ private:
 		return (a << 24) | (b << 16) | (c << 8) | d;
 	}
 
-	void putPixelRaw(uint16_t *dst, uint8_t y)
+	// Convert the 4 luma values of a codebook entry sharing u and v, the
+	// chroma offsets are applied to the table bases once per entry
+	inline void putPixels(pixel_t *dst, const uint8_t *y, int8_t u, int8_t v)
 	{
-		// *dst = (((0xF8 & y) << 8) | ((0xFC & y) << 3) | ((y) >> 3));
-		*dst = (((0xF8 & y)) | ((y) >> 5) | ((0x1C & y) << 11) | ((0xF8 & y) << 5));
+		putPixels(dst, y, u, v, std::integral_constant<bool, PIXEL::packed>());
 	}
 
-	void putPixelRaw(uint16_t *dst, uint8_t y, int8_t u, int8_t v)
+	inline void putPixels(pixel_t *dst, const uint8_t *y, int8_t u, int8_t v, std::true_type)
 	{
-		uint8_t r = _clipTable[y + (v << 1)];
-		uint8_t g = _clipTable[y - (u >> 1) - v];
-		uint8_t b = _clipTable[y + (u << 1)];
-#ifdef BIG_ENDIAN_PIXEL
-		*dst = (((0xF8 & r)) | ((g) >> 5) | ((0x1C & g) << 11) | ((0xF8 & b) << 5));
-#else
-		*dst = (((0xF8 & r) << 8) | ((0xFC & g) << 3) | ((b) >> 3));
-#endif
+		const pixel_t *r = _rgbTableBuf + 256 + (v << 1);
+		const pixel_t *g = _rgbTableBuf + 768 + 256 - (u >> 1) - v;
+		const pixel_t *b = _rgbTableBuf + 1536 + 256 + (u << 1);
+		dst[0] = r[y[0]] | g[y[0]] | b[y[0]];
+		dst[1] = r[y[1]] | g[y[1]] | b[y[1]];
+		dst[2] = r[y[2]] | g[y[2]] | b[y[2]];
+		dst[3] = r[y[3]] | g[y[3]] | b[y[3]];
 	}
 
-	void loadCodebook(uint16_t *codeblock, uint8_t chunkID, uint32_t chunkSize)
+	inline void putPixels(pixel_t *dst, const uint8_t *y, int8_t u, int8_t v, std::false_type)
+	{
+		const uint8_t *r = _clipTableBuf + 512 + (v << 1);
+		const uint8_t *g = _clipTableBuf + 512 - (u >> 1) - v;
+		const uint8_t *b = _clipTableBuf + 512 + (u << 1);
+		for (uint8_t i = 0; i < 4; i++)
+		{
+			dst[i] = PIXEL::rgb(r[y[i]], g[y[i]], b[y[i]]);
+		}
+	}
+
+	template <bool V1>
+	void loadCodebook(uint8_t chunkID, uint32_t chunkSize)
 	{
 		// Serial.printf("loadCodebook(%d, %d, %d)\n", chunkID, chunkSize);
 
@@ -262,177 +750,520 @@ private:
 				if ((_data_pos - startPos + n) > (int32_t)chunkSize)
 					break;
 
-				uint8_t *y = _data + _data_pos;
+				const uint8_t *y = _data + _data_pos;
 				_data_pos += 4;
-				uint16_t *p = codeblock + (i << 2);
+#ifdef CINEPAK_TRANSFORM
+				uint8_t ty[4];
+				if (_transform)
+				{
+					y = transformLuma<V1>(y, ty);
+				}
+#endif
+				pixel_t c[4];
+				pixel_t *p = V1 ? c : (_v4_codebook + (i << 2));
 				if (n == 6)
 				{
 					int8_t u = readUint8();
 					int8_t v = readUint8();
-					putPixelRaw(p++, y[0], u, v);
-					putPixelRaw(p++, y[1], u, v);
-					putPixelRaw(p++, y[2], u, v);
-					putPixelRaw(p, y[3], u, v);
+					putPixels(p, y, u, v);
 				}
 				else
 				{
 					// This codebook type indicates either greyscale or
 					// palettized video. For greyscale, default us to
 					// 0 for both u and v.
-					putPixelRaw(p++, y[0]);
-					putPixelRaw(p++, y[1]);
-					putPixelRaw(p++, y[2]);
-					putPixelRaw(p, y[3]);
+					putPixels(p, y, 0, 0);
+				}
+
+				if (V1)
+				{
+					pixel_t *tile = _v1_tiles + (i << 3);
+					tile[0] = c[0];
+					tile[1] = c[0];
+					tile[2] = c[1];
+					tile[3] = c[1];
+					tile[4] = c[2];
+					tile[5] = c[2];
+					tile[6] = c[3];
+					tile[7] = c[3];
 				}
 			}
 		}
 	}
 
+#ifdef USE_DRAW_CALLBACK
+	// Join the updated block at x to the span of horizontally adjacent blocks,
+	// drawing the span first if the block does not continue it
+	inline void addSpanBlock(uint16_t x, uint16_t y)
+	{
+		if ((_span_x0 >= 0) && (x != _span_x1))
+		{
+			drawSpan();
+		}
+		if (_span_x0 < 0)
+		{
+			_span_x0 = x;
+			_span_y = y;
+		}
+		_span_x1 = x + 4;
+	}
+
+	// Draw the span with one callback. Its rows are packed to the start of
+	// the band buffer first, the blocks still to come overwrite that area.
+	void drawSpan()
+	{
+		if (_span_x0 < 0)
+		{
+			return;
+		}
+
+		uint16_t w = _span_x1 - _span_x0;
+		if (w < _width)
+		{
+			for (uint8_t i = 0; i < 4; i++)
+			{
+				memmove(_output_buf + (i * w), _output_buf + (i * _width) + _span_x0, w * sizeof(pixel_t));
+			}
+			_draw(_span_x0, _span_y, _output_buf, w, 4);
+		}
+		else
+		{
+			_draw(0, _span_y, _output_buf, _width, 4);
+		}
+		_span_x0 = -1;
+	}
+#endif // USE_DRAW_CALLBACK
+
+#ifdef CINEPAK_TRANSFORM
+	void initTransform()
+	{
+		_scaled_width = ((_width + 3) >> 2) * _block_size;
+		_scaled_height = ((_height + 3) >> 2) * _block_size;
+		_out_stride = (_rotation & 1) ? _scaled_height : _scaled_width;
+		_rows_aligned = !(((uintptr_t)_output_buf) & 3) && !((_out_stride * sizeof(pixel_t)) & 3);
+	}
+
+	// Top left output pixel of the block at x, y
+	inline pixel_t *blockOutput(uint16_t x, uint16_t y)
+	{
+		int32_t n = _block_size;
+		int32_t bx = (x >> 2) * n;
+		int32_t by = (y >> 2) * n;
+		switch (_rotation)
+		{
+		case 1:
+			return _output_buf + (bx * _out_stride) + (_scaled_height - by - n);
+		case 2:
+			return _output_buf + ((_scaled_height - by - n) * _out_stride) + (_scaled_width - bx - n);
+		case 3:
+			return _output_buf + ((_scaled_width - bx - n) * _out_stride) + by;
+		default:
+			return _output_buf + (by * _out_stride) + bx;
+		}
+	}
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+	// Map a source rectangle of whole blocks to the output
+	void transformRect(CinepakRect *r)
+	{
+		int32_t n = _block_size;
+		int32_t x = (r->x >> 2) * n;
+		int32_t y = (r->y >> 2) * n;
+		int32_t w = (r->w >> 2) * n;
+		int32_t h = (r->h >> 2) * n;
+		switch (_rotation)
+		{
+		case 1:
+			r->x = _scaled_height - y - h;
+			r->y = x;
+			r->w = h;
+			r->h = w;
+			break;
+		case 2:
+			r->x = _scaled_width - x - w;
+			r->y = _scaled_height - y - h;
+			r->w = w;
+			r->h = h;
+			break;
+		case 3:
+			r->x = y;
+			r->y = _scaled_width - x - w;
+			r->w = h;
+			r->h = w;
+			break;
+		default:
+			r->x = x;
+			r->y = y;
+			r->w = w;
+			r->h = h;
+		}
+	}
+#endif // CINEPAK_DIRTY_BLOCKS
+
+	// Luma of a codebook entry in the output orientation. At half scale a
+	// V4 entry becomes a single pixel, its average.
+	template <bool V1>
+	inline const uint8_t *transformLuma(const uint8_t *y, uint8_t *ty)
+	{
+		if (!V1 && (_block_size == 2))
+		{
+			uint8_t a = (y[0] + y[1] + y[2] + y[3] + 2) >> 2;
+			ty[0] = a;
+			ty[1] = a;
+			ty[2] = a;
+			ty[3] = a;
+		}
+		else
+		{
+			ty[0] = y[_quad[0]];
+			ty[1] = y[_quad[1]];
+			ty[2] = y[_quad[2]];
+			ty[3] = y[_quad[3]];
+		}
+		return ty;
+	}
+
+	// Write a block at its output position, the codebook entries are already
+	// rotated, the quadrants are picked in the output order
+	inline void putTransformedBlock(pixel_t *dst, bool v4, const uint8_t *data)
+	{
+		int32_t s = _out_stride;
+		if (_block_size == 4)
+		{
+			if (v4)
+			{
+				uint8_t i[4] = {data[_quad[0]], data[_quad[1]], data[_quad[2]], data[_quad[3]]};
+				putV4Block(dst, dst + s, dst + (2 * s), dst + (3 * s), i);
+			}
+			else
+			{
+				putV1Block(dst, dst + s, dst + (2 * s), dst + (3 * s), *data);
+			}
+		}
+		else if (_block_size == 2)
+		{
+			if (v4)
+			{
+				dst[0] = _v4_codebook[data[_quad[0]] << 2];
+				dst[1] = _v4_codebook[data[_quad[1]] << 2];
+				dst[s] = _v4_codebook[data[_quad[2]] << 2];
+				dst[s + 1] = _v4_codebook[data[_quad[3]] << 2];
+			}
+			else
+			{
+				const pixel_t *tile = _v1_tiles + (*data << 3);
+				dst[0] = tile[0];
+				dst[1] = tile[2];
+				dst[s] = tile[4];
+				dst[s + 1] = tile[6];
+			}
+		}
+		else if (v4)
+		{
+			for (uint8_t q = 0; q < 4; q++)
+			{
+				const pixel_t *e = _v4_codebook + (data[_quad[q]] << 2);
+				pixel_t *row = dst + ((q & 2) ? (4 * s) : 0) + ((q & 1) ? 4 : 0);
+				for (uint8_t j = 0; j < 4; j++, row += s)
+				{
+					const pixel_t *p = e + ((j & 2) ? 2 : 0);
+					row[0] = p[0];
+					row[1] = p[0];
+					row[2] = p[1];
+					row[3] = p[1];
+				}
+			}
+		}
+		else
+		{
+			const pixel_t *tile = _v1_tiles + (*data << 3);
+			pixel_t *row = dst;
+			for (uint8_t j = 0; j < 8; j++, row += s)
+			{
+				const pixel_t *p = tile + ((j & 4) ? 4 : 0);
+				for (uint8_t k = 0; k < 8; k++)
+				{
+					row[k] = p[k >> 1];
+				}
+			}
+		}
+	}
+#endif // CINEPAK_TRANSFORM
+
 	void decodeVectors(uint8_t chunkID, uint32_t chunkSize)
 	{
 		// Serial.printf("decodeVectors(), chunkSize: %lu, _strip_top: %d, _strip_bottom: %d\n", chunkSize, _strip_top, _strip_bottom);
 
-		uint32_t flag = 0, mask = 0;
-		uint16_t x, y;
-		uint16_t *row0;
-		uint16_t *row1;
-		uint16_t *row2;
-		uint16_t *row3;
-		int32_t startPos = _data_pos;
-		uint16_t *codeblock;
+#ifdef CINEPAK_TRANSFORM
+		if (_transform)
+		{
+			switch (chunkID)
+			{
+			case 0x30:
+				decodeVectorsT<0x30, false, true>(chunkSize);
+				break;
+			case 0x31:
+				decodeVectorsT<0x31, false, true>(chunkSize);
+				break;
+			case 0x32:
+				decodeVectorsT<0x32, false, true>(chunkSize);
+				break;
+			}
+			return;
+		}
+#endif
 
 #ifdef USE_DRAW_CALLBACK
-		uint16_t w = _iskeyframe ? _width : 4;
+		if (!_iskeyframe)
+		{
+			switch (chunkID)
+			{
+			case 0x30:
+				decodeVectorsT<0x30, true>(chunkSize);
+				break;
+			case 0x31:
+				decodeVectorsT<0x31, true>(chunkSize);
+				break;
+			case 0x32:
+				decodeVectorsT<0x32, true>(chunkSize);
+				break;
+			}
+			return;
+		}
 #endif
+
+		switch (chunkID)
+		{
+		case 0x30:
+			decodeVectorsT<0x30, false>(chunkSize);
+			break;
+		case 0x31:
+			decodeVectorsT<0x31, false>(chunkSize);
+			break;
+		case 0x32:
+			decodeVectorsT<0x32, false>(chunkSize);
+			break;
+		}
+	}
+
+	inline void putV1Block(pixel_t *row0, pixel_t *row1, pixel_t *row2, pixel_t *row3, uint8_t i)
+	{
+		const pixel_t *tile = _v1_tiles + (i << 3);
+		if (_rows_aligned)
+		{
+			// whole rows, the compiler emits 32-bit (or wider) stores
+			memcpy(__builtin_assume_aligned(row0, 4), tile, 4 * sizeof(pixel_t));
+			memcpy(__builtin_assume_aligned(row1, 4), tile, 4 * sizeof(pixel_t));
+			memcpy(__builtin_assume_aligned(row2, 4), tile + 4, 4 * sizeof(pixel_t));
+			memcpy(__builtin_assume_aligned(row3, 4), tile + 4, 4 * sizeof(pixel_t));
+		}
+		else
+		{
+			for (uint8_t j = 0; j < 4; j++)
+			{
+				row0[j] = tile[j];
+				row1[j] = tile[j];
+				row2[j] = tile[j + 4];
+				row3[j] = tile[j + 4];
+			}
+		}
+	}
+
+	inline void putV4Block(pixel_t *row0, pixel_t *row1, pixel_t *row2, pixel_t *row3, const uint8_t *i)
+	{
+		pixel_t *codeblock = _v4_codebook + (i[0] << 2);
+		row0[0] = codeblock[0];
+		row0[1] = codeblock[1];
+		row1[0] = codeblock[2];
+		row1[1] = codeblock[3];
+
+		codeblock = _v4_codebook + (i[1] << 2);
+		row0[2] = codeblock[0];
+		row0[3] = codeblock[1];
+		row1[2] = codeblock[2];
+		row1[3] = codeblock[3];
+
+		codeblock = _v4_codebook + (i[2] << 2);
+		row2[0] = codeblock[0];
+		row2[1] = codeblock[1];
+		row3[0] = codeblock[2];
+		row3[1] = codeblock[3];
+
+		codeblock = _v4_codebook + (i[3] << 2);
+		row2[2] = codeblock[0];
+		row2[3] = codeblock[1];
+		row3[2] = codeblock[2];
+		row3[3] = codeblock[3];
+	}
+
+	// One copy of the block loop per vector chunk type, so the chunk type and
+	// output mode tests fold away at compile time:
+	// 0x30 codes every block with V1 or V4, a flag bit each
+	// 0x31 also skips blocks, a skip bit before the V1/V4 bit of each block
+	// 0x32 codes every block with V1, no flag bits
+	// SPANS draws the updated blocks in spans, otherwise USE_DRAW_CALLBACK
+	// draws whole bands. TRANSFORM places the blocks by setTransform().
+	template <uint8_t CHUNK_ID, bool SPANS, bool TRANSFORM = false>
+	void decodeVectorsT(uint32_t chunkSize)
+	{
+		const bool selective = CHUNK_ID & 0x01;
+		const bool v1_only = CHUNK_ID & 0x02;
+
+		uint32_t flag = 0, mask = 0;
+		uint16_t x, y;
+		pixel_t *row0;
+		pixel_t *row1;
+		pixel_t *row2;
+		pixel_t *row3;
+		const uint8_t *data = _data + _data_pos;
+		int32_t left = chunkSize; // bytes left in the chunk
+
 		for (y = _strip_top; y < _strip_bottom; y += 4)
 		{
+#ifdef CINEPAK_TRANSFORM
+			if (TRANSFORM)
+			{
+				if ((y + 4) > ((_height + 3) & ~3))
+				{
+					break; // no output rows below the frame
+				}
+			}
+#endif
+#ifdef CINEPAK_DIRTY_BLOCKS
+			uint16_t *dirty = _dirty + (((y >> 2) < _dirty_bands) ? ((y >> 2) << 1) : 0);
+#endif
 #ifdef USE_DRAW_CALLBACK
-			row0 = _output_buf;
-			row1 = row0 + w;
-			row2 = row1 + w;
-			row3 = row2 + w;
+			row0 = _output_buf; // one 4-row band
 #else
 			row0 = _output_buf + (y * _width);
+#endif
 			row1 = row0 + _width;
 			row2 = row1 + _width;
 			row3 = row2 + _width;
-#endif
 
-			for (x = 0; x < _width; x += 4)
+			for (x = 0; x < _width; x += 4, row0 += 4, row1 += 4, row2 += 4, row3 += 4)
 			{
-				if ((chunkID & 0x01) && !(mask >>= 1))
-				{
-					if ((_data_pos - startPos + 4) > (int32_t)chunkSize)
-						return;
-
-					flag = readUint32BE();
-					mask = 0x80000000;
-				}
-
-				if (!(chunkID & 0x01) || (flag & mask))
+				if (selective)
 				{
-					if (!(chunkID & 0x02) && !(mask >>= 1))
+					if (!(mask >>= 1))
 					{
-						if ((_data_pos - startPos + 4) > (int32_t)chunkSize)
+						if (left < 4)
+						{
+							_data_pos = data - _data;
 							return;
-
-						flag = readUint32BE();
+						}
+						flag = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+						data += 4;
+						left -= 4;
 						mask = 0x80000000;
 					}
-
-					if ((chunkID & 0x02) || (~flag & mask))
+					if (!(flag & mask))
 					{
-						if ((_data_pos - startPos + 1) > (int32_t)chunkSize)
-							return;
-
-						// Get the codeblock
-						codeblock = _v1_codebook + (readUint8() << 2);
-						uint16_t codebit = *codeblock++;
-						row0[0] = codebit;
-						row0[1] = codebit;
-						row1[0] = codebit;
-						row1[1] = codebit;
-
-						codebit = *codeblock++;
-						row0[2] = codebit;
-						row0[3] = codebit;
-						row1[2] = codebit;
-						row1[3] = codebit;
-
-						codebit = *codeblock++;
-						row2[0] = codebit;
-						row2[1] = codebit;
-						row3[0] = codebit;
-						row3[1] = codebit;
-
-						codebit = *codeblock;
-						row2[2] = codebit;
-						row2[3] = codebit;
-						row3[2] = codebit;
-						row3[3] = codebit;
+						continue; // unchanged block
+					}
+				}
 
-#ifdef USE_DRAW_CALLBACK
-						if (!_iskeyframe)
+				bool v4 = false;
+				if (!v1_only)
+				{
+					if (!(mask >>= 1))
+					{
+						if (left < 4)
 						{
-							_draw(x, y, _output_buf, 4, 4);
+							_data_pos = data - _data;
+							return;
 						}
-#endif
+						flag = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+						data += 4;
+						left -= 4;
+						mask = 0x80000000;
 					}
-					else if (flag & mask)
-					{
-						if ((_data_pos - startPos + 4) > (int32_t)chunkSize)
-							return;
+					v4 = flag & mask;
+				}
 
-						codeblock = _v4_codebook + (readUint8() << 2);
-						row0[0] = *codeblock++;
-						row0[1] = *codeblock++;
-						row1[0] = *codeblock++;
-						row1[1] = *codeblock;
-
-						codeblock = _v4_codebook + (readUint8() << 2);
-						row0[2] = *codeblock++;
-						row0[3] = *codeblock++;
-						row1[2] = *codeblock++;
-						row1[3] = *codeblock;
-
-						codeblock = _v4_codebook + (readUint8() << 2);
-						row2[0] = *codeblock++;
-						row2[1] = *codeblock++;
-						row3[0] = *codeblock++;
-						row3[1] = *codeblock;
-
-						codeblock = _v4_codebook + (readUint8() << 2);
-						row2[2] = *codeblock++;
-						row2[3] = *codeblock++;
-						row3[2] = *codeblock++;
-						row3[3] = *codeblock;
+				uint8_t n = v4 ? 4 : 1;
+				if (left < n)
+				{
+					_data_pos = data - _data;
+					return;
+				}
 
 #ifdef USE_DRAW_CALLBACK
-						if (!_iskeyframe)
-						{
-							_draw(x, y, _output_buf, 4, 4);
-						}
-#endif
-					}
+				if (SPANS)
+				{
+					addSpanBlock(x, y);
 				}
+#endif
 
-#ifdef USE_DRAW_CALLBACK
-				if (_iskeyframe)
+#ifdef CINEPAK_TRANSFORM
+				if (TRANSFORM)
+				{
+					putTransformedBlock(blockOutput(x, y), v4, data);
+				}
+				else if (v4)
+#else
+				if (v4)
 #endif
 				{
-					row0 += 4;
-					row1 += 4;
-					row2 += 4;
-					row3 += 4;
+					putV4Block(row0, row1, row2, row3, data);
+				}
+				else
+				{
+					putV1Block(row0, row1, row2, row3, *data);
 				}
+				data += n;
+				left -= n;
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+				if (dirty[0] > x)
+					dirty[0] = x;
+				if (dirty[1] < x + 4)
+					dirty[1] = x + 4;
+#endif
 			}
 
 #ifdef USE_DRAW_CALLBACK
-			if (_iskeyframe)
+			if (SPANS)
+			{
+				drawSpan();
+			}
+			else
 			{
 				_draw(0, y, _output_buf, _width, 4);
 			}
 #endif
 		}
+
+		_data_pos = data - _data;
 	}
 };
+
+template <class PIXEL>
+uint8_t CinepakDecoderT<PIXEL>::_clipTableBuf[1024];
+template <class PIXEL>
+typename PIXEL::pixel_t CinepakDecoderT<PIXEL>::_rgbTableBuf[768 * 3];
+template <class PIXEL>
+bool CinepakDecoderT<PIXEL>::_tables_ready = false;
+
+/**
+ * CinepakDecoderT holding the codebooks of its single stream.
+ */
+template <class PIXEL>
+class CinepakDecoderWithCodebooksT : public CinepakDecoderT<PIXEL>
+{
+public:
+	CinepakDecoderWithCodebooksT() : CinepakDecoderT<PIXEL>(_own_codebooks)
+	{
+	}
+
+private:
+	typename CinepakDecoderT<PIXEL>::codebooks_t _own_codebooks[CINEPAK_CODEBOOK_SETS];
+};
+
+#ifdef BIG_ENDIAN_PIXEL
+typedef CinepakDecoderWithCodebooksT<CinepakRGB565BE> CinepakDecoder;
+typedef CinepakDecoderT<CinepakRGB565BE> CinepakPooledDecoder;
+#else
+typedef CinepakDecoderWithCodebooksT<CinepakRGB565LE> CinepakDecoder;
+typedef CinepakDecoderT<CinepakRGB565LE> CinepakPooledDecoder;
+#endif
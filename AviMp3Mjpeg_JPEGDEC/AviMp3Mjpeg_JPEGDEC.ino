@@ -37,11 +37,15 @@ int drawMCU(JPEGDRAW *pDraw)
 {
   // Serial.printf("Draw pos = (%d, %d), size = %d x %d\n", pDraw->x, pDraw->y, pDraw->iWidth, pDraw->iHeight);
 
+#ifdef AVI_MCU_PING_PONG
+  avi_mcu_queue(pDraw);
+#else
   unsigned long s = millis();
-  gfx->draw16bitBeRGBBitmap(pDraw->x, pDraw->y, pDraw->pPixels, pDraw->iWidth, pDraw->iHeight);
+  avi_mcu_show(pDraw);
   s = millis() - s;
   avi_total_show_video_ms += s;
   avi_total_decode_video_ms -= s;
+#endif
 
   return 1;
 }
@@ -1,9 +1,57 @@
 #define AVI_SUPPORT_CINEPAK
 #define AVI_SUPPORT_MJPEG
 // #define AVI_SUPPORT_AUDIO // should define before include this header
+// #define AVI_INDEX_CACHE // should define before include this header
+// #define AVI_READ_AHEAD_SIZE (64 * 1024) // should define before include this header, read-ahead window in PSRAM
+// #define AVI_STREAMING // should define before include this header, play the movi list in file order without index
+// #define AVI_READER_TASK_SLOTS 3 // should define before include this header, compressed frames a reader task keeps ahead of the decoder
+// #define AVI_LOAD_TO_RAM_MAX (4 * 1024 * 1024) // should define before include this header, copy clips up to this size into PSRAM
+// #define CINEPAK_PARALLEL // should define before include this header, decode the Cinepak strips on both cores
+// #define CINEPAK_DIRTY_BLOCKS // should define before include this header, only push the Cinepak blocks that changed to the display
+// #define AVI_CINEPAK_CATCH_UP_MS 500 // should define before include this header, lag that makes Cinepak drop frames up to the next keyframe
+// #define AVI_MJPEG_PIPELINE // should define before include this header, a worker task decodes MJPEG frame N into a back buffer while frame N + 1 is read and frame N - 1 is shown
+// #define AVI_MJPEG_FRAME_PARALLEL // should define before include this header, the MJPEG pipeline with a worker on each core, even frames on core 0 and odd frames on core 1
+// #define AVI_CINEPAK_SCALE CINEPAK_SCALE_2 // should define before include this header, Cinepak output scale: CINEPAK_SCALE_1, CINEPAK_SCALE_2 or CINEPAK_SCALE_HALF
+// #define AVI_CINEPAK_ROTATION 1 // should define before include this header, Cinepak output rotation in 90 degree clockwise steps: 0-3
 
 #include "avilibRead.h"
 
+#if defined(AVI_READER_TASK_SLOTS) && defined(AVI_STREAMING)
+#error "AVI_READER_TASK_SLOTS reads by the index, it cannot be used with AVI_STREAMING"
+#endif
+#if defined(AVI_LOAD_TO_RAM_MAX) && defined(AVI_STREAMING)
+#error "AVI_LOAD_TO_RAM_MAX reads by the index, it cannot be used with AVI_STREAMING"
+#endif
+#if defined(AVI_CINEPAK_CATCH_UP_MS) && defined(AVI_STREAMING)
+#error "AVI_CINEPAK_CATCH_UP_MS finds the keyframes in the index, it cannot be used with AVI_STREAMING"
+#endif
+
+#ifdef AVI_MJPEG_FRAME_PARALLEL
+#define AVI_MJPEG_PIPELINE
+#define AVI_MJPEG_WORKERS 2
+#else
+#define AVI_MJPEG_WORKERS 1
+#endif
+#if defined(AVI_MJPEG_FRAME_PARALLEL) && defined(ESP32) && (CONFIG_IDF_TARGET_ESP32P4)
+#error "AVI_MJPEG_FRAME_PARALLEL decodes in software, the ESP32-P4 JPEG engine takes one frame at a time"
+#endif
+#if defined(AVI_MJPEG_PIPELINE) && (defined(AVI_STREAMING) || defined(AVI_READER_TASK_SLOTS))
+#error "AVI_MJPEG_PIPELINE reads one frame ahead itself, it cannot be used with AVI_STREAMING or AVI_READER_TASK_SLOTS"
+#endif
+#if defined(AVI_MJPEG_PIPELINE) && (defined(RGB_PANEL) || defined(DSI_PANEL))
+#error "AVI_MJPEG_PIPELINE swaps output_buf with a back buffer, it cannot be used with the panel framebuffer"
+#endif
+
+#if defined(AVI_CINEPAK_SCALE) || defined(AVI_CINEPAK_ROTATION)
+#define CINEPAK_TRANSFORM
+#ifndef AVI_CINEPAK_SCALE
+#define AVI_CINEPAK_SCALE CINEPAK_SCALE_1
+#endif
+#ifndef AVI_CINEPAK_ROTATION
+#define AVI_CINEPAK_ROTATION 0
+#endif
+#endif
+
 #define SKIP_FRAME_TOLERANT_MS 250
 
 #define MAX_AUDIO_FRAME_SIZE 1024 * 3
@@ -31,9 +79,9 @@ CinepakDecoder cinepak;
 jpeg_decoder_handle_t decoder_engine;
 #else
 #include <ESP32_JPEG_Library.h>
-jpeg_dec_handle_t *jpeg_dec;
-jpeg_dec_io_t *jpeg_io;
-jpeg_dec_header_info_t *out_info;
+jpeg_dec_handle_t *jpeg_dec[AVI_MJPEG_WORKERS]; // one per pipeline worker
+jpeg_dec_io_t *jpeg_io[AVI_MJPEG_WORKERS];
+jpeg_dec_header_info_t *out_info[AVI_MJPEG_WORKERS];
 #endif
 #endif // AVI_SUPPORT_MJPEG
 
@@ -45,6 +93,7 @@ double avi_fr;
 char *avi_compressor;
 long avi_vcodec;
 long estimateBufferSize;
+long avi_init_buffer_size; // estimateBufferSize from avi_init, vidbuf shrinks back to it on close
 char *vidbuf;
 size_t output_buf_size;
 uint16_t *output_buf;
@@ -55,6 +104,41 @@ unsigned long avi_start_ms, avi_next_frame_ms, avi_skip_frame_ms;
 unsigned long avi_total_read_video_ms;
 unsigned long avi_total_decode_video_ms;
 unsigned long avi_total_show_video_ms;
+unsigned long avi_video_index_lookups, avi_video_index_steps;
+long avi_index_segment_loads;
+unsigned long avi_read_ahead_hits, avi_read_ahead_misses, avi_read_ahead_fills, avi_read_ahead_bytes;
+unsigned long avi_seeks, avi_seek_decoded_frames, avi_seek_start_ms, avi_total_seek_ms, avi_max_seek_ms;
+bool avi_seek_pending; // seek latency is taken when the target frame is shown
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+unsigned long avi_catch_ups, avi_catch_up_frames;
+#endif // AVI_CINEPAK_CATCH_UP_MS
+#ifdef CINEPAK_DIRTY_BLOCKS
+#define AVI_MAX_DIRTY_RECTS 32
+#define AVI_DIRTY_BUF_PIXELS (16 * 1024)
+CinepakRect avi_dirty_rects[AVI_MAX_DIRTY_RECTS];
+uint16_t *avi_dirty_buf; // rows of a narrow rect packed together, pushed in one call
+unsigned long avi_show_frames, avi_show_rects, avi_show_bytes; // pixel bytes sent to the display
+#endif // CINEPAK_DIRTY_BLOCKS
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+typedef struct
+{
+  char *data;
+  long len;
+  uint16_t *out;      // decode target, swapped with output_buf when the frame is taken
+  bool pending;       // submitted, the result not taken yet
+  volatile bool done; // decoded, set before the caller is notified
+  unsigned long decode_ms;
+  TaskHandle_t task_handle;
+} avi_mjpeg_worker_t;
+avi_mjpeg_worker_t avi_mjpeg_workers[AVI_MJPEG_WORKERS];
+int avi_mjpeg_head;                         // worker with the oldest frame in flight, frames are taken in submit order
+int avi_mjpeg_in_flight;                    // frames from avi_curr_frame on that are on the workers
+char *avi_mjpeg_vidbufs[AVI_MJPEG_WORKERS]; // read buffers beside vidbuf
+long avi_mjpeg_vidbuf_size;
+TaskHandle_t avi_mjpeg_caller_task;
+unsigned long avi_mjpeg_frames, avi_mjpeg_wait_ms; // time the play loop still waits for the worker
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
 
 #ifdef AVI_SUPPORT_AUDIO
 char *audbuf;
@@ -65,9 +149,53 @@ unsigned long total_decode_audio_ms;
 unsigned long total_play_audio_ms;
 #endif // AVI_SUPPORT_AUDIO
 
+#ifdef AVI_STREAMING
+bool avi_stream_vid_ready; // video chunk waiting in vidbuf
+long avi_stream_vid_len;
+bool avi_stream_eof;
+unsigned long avi_stream_video_chunks, avi_stream_audio_chunks, avi_stream_dropped_chunks;
+#ifdef AVI_SUPPORT_AUDIO
+char *avi_stream_audbuf; // audio chunk waiting for the audio task
+long avi_stream_aud_len;
+#endif // AVI_SUPPORT_AUDIO
+#endif // AVI_STREAMING
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+bool avi_mjpeg_task_start();
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
+
+#ifdef AVI_READER_TASK_SLOTS
+typedef struct
+{
+  char *buf;        // size bytes, slot 0 is vidbuf
+  long size;        // estimateBufferSize at start, the reader task grows it to fit the frames
+  char *data;       // frame data, buf or the RAM image
+  long len;         // -1 if the frame is larger than buf
+  long video_bytes; // frame size in the index, for the decoder to report
+  int is_key_frame;
+} avi_reader_slot_t;
+avi_reader_slot_t avi_reader_slots[AVI_READER_TASK_SLOTS];
+QueueHandle_t avi_reader_free_queue;  // slot numbers ready to be filled
+QueueHandle_t avi_reader_ready_queue; // slot numbers holding the next frames in order
+TaskHandle_t avi_reader_task_handle;
+volatile bool avi_reader_stop;
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+volatile long avi_reader_key_frame_from; // frame the decoder asks the next keyframe for, -1 if none
+volatile long avi_reader_key_frame;      // the reader task's answer
+#endif // AVI_CINEPAK_CATCH_UP_MS
+long avi_reader_slot_count;
+long avi_reader_curr_slot; // slot held by the decoder, -1 if none
+unsigned long avi_reader_stalls, avi_reader_stall_ms, avi_reader_max_stall_ms;
+unsigned long avi_reader_depth_sum, avi_reader_depth_samples;
+long avi_reader_min_depth, avi_reader_max_depth;
+bool avi_reader_task_start();
+void avi_reader_task_stop();
+#endif // AVI_READER_TASK_SLOTS
+
 bool avi_init()
 {
   estimateBufferSize = output_buf_size / 5;
+  avi_init_buffer_size = estimateBufferSize;
   vidbuf = (char *)heap_caps_malloc(estimateBufferSize, MALLOC_CAP_8BIT);
   if (!vidbuf)
   {
@@ -82,8 +210,25 @@ bool avi_init()
     Serial.println("audbuf heap_caps_malloc failed!");
     return false;
   }
+#ifdef AVI_STREAMING
+  avi_stream_audbuf = (char *)heap_caps_malloc(MAX_AUDIO_FRAME_SIZE, MALLOC_CAP_8BIT);
+  if (!avi_stream_audbuf)
+  {
+    Serial.println("avi_stream_audbuf heap_caps_malloc failed!");
+    return false;
+  }
+#endif // AVI_STREAMING
 #endif // AVI_SUPPORT_AUDIO
 
+#ifdef CINEPAK_DIRTY_BLOCKS
+  avi_dirty_buf = (uint16_t *)heap_caps_malloc(AVI_DIRTY_BUF_PIXELS * 2, MALLOC_CAP_8BIT);
+  if (!avi_dirty_buf)
+  {
+    Serial.println("avi_dirty_buf heap_caps_malloc failed!");
+    return false;
+  }
+#endif // CINEPAK_DIRTY_BLOCKS
+
 #ifdef AVI_SUPPORT_MJPEG
 #if defined(ESP32) && (CONFIG_IDF_TARGET_ESP32P4)
   jpeg_decode_engine_cfg_t decode_eng_cfg = {
@@ -101,30 +246,152 @@ bool avi_init()
 #endif
       .rotate = JPEG_ROTATE_0D,
   };
-  // Create jpeg_dec
-  jpeg_dec = jpeg_dec_open(&config);
+  for (int i = 0; i < AVI_MJPEG_WORKERS; ++i)
+  {
+    // Create jpeg_dec
+    jpeg_dec[i] = jpeg_dec_open(&config);
 
-  // Create io_callback handle
-  jpeg_io = (jpeg_dec_io_t *)calloc(1, sizeof(jpeg_dec_io_t));
+    // Create io_callback handle
+    jpeg_io[i] = (jpeg_dec_io_t *)calloc(1, sizeof(jpeg_dec_io_t));
 
-  // Create out_info handle
-  out_info = (jpeg_dec_header_info_t *)calloc(1, sizeof(jpeg_dec_header_info_t));
+    // Create out_info handle
+    out_info[i] = (jpeg_dec_header_info_t *)calloc(1, sizeof(jpeg_dec_header_info_t));
+  }
 #endif
+#ifdef AVI_MJPEG_PIPELINE
+  if (!avi_mjpeg_task_start())
+  {
+    return false;
+  }
+#endif // AVI_MJPEG_PIPELINE
 #endif // AVI_SUPPORT_MJPEG
 
   return true;
 }
 
+// grow vidbuf, and the MJPEG pipeline read buffers, to fit a frame of video_bytes or the
+// largest frame known by now; OpenDML files only know theirs as the index segments load.
+// Returns false if the frame still does not fit.
+bool avi_grow_vidbuf(long video_bytes)
+{
+  long size = max(video_bytes, AVI_max_video_chunk(avi));
+  if (size > estimateBufferSize)
+  {
+    char *p = (char *)heap_caps_realloc(vidbuf, size, MALLOC_CAP_8BIT);
+    if (!p)
+    {
+      Serial.printf("vidbuf heap_caps_realloc(%ld) failed!\n", size);
+      return false;
+    }
+    vidbuf = p;
+    estimateBufferSize = size;
+  }
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  if (estimateBufferSize > avi_mjpeg_vidbuf_size)
+  {
+    int i = 0;
+    while (i < AVI_MJPEG_WORKERS)
+    {
+      char *p = (char *)heap_caps_realloc(avi_mjpeg_vidbufs[i], estimateBufferSize, MALLOC_CAP_8BIT);
+      if (!p)
+      {
+        Serial.printf("avi_mjpeg_vidbufs[%d] heap_caps_realloc(%ld) failed!\n", i, estimateBufferSize);
+        break;
+      }
+      avi_mjpeg_vidbufs[i++] = p;
+    }
+    if (i == AVI_MJPEG_WORKERS)
+    {
+      avi_mjpeg_vidbuf_size = estimateBufferSize;
+    }
+    else
+    {
+      estimateBufferSize = avi_mjpeg_vidbuf_size; // all read buffers hold the frames
+    }
+  }
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
+  return video_bytes <= estimateBufferSize;
+}
+
+// zero the counters avi_show_stat() reports, e.g. before playing the clip again
+void avi_reset_stat()
+{
+  avi_skipped_frames = 0;
+
+  avi_total_read_video_ms = 0;
+  avi_total_decode_video_ms = 0;
+  avi_total_show_video_ms = 0;
+
+#ifdef AVI_SUPPORT_AUDIO
+  avi_total_read_audio_ms = 0;
+  total_decode_audio_ms = 0;
+  total_play_audio_ms = 0;
+#endif // AVI_SUPPORT_AUDIO
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+  avi_show_frames = 0;
+  avi_show_rects = 0;
+  avi_show_bytes = 0;
+#endif // CINEPAK_DIRTY_BLOCKS
+
+  avi_seeks = 0;
+  avi_seek_decoded_frames = 0;
+  avi_total_seek_ms = 0;
+  avi_max_seek_ms = 0;
+  avi_seek_pending = false;
+
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+  avi_catch_ups = 0;
+  avi_catch_up_frames = 0;
+#endif // AVI_CINEPAK_CATCH_UP_MS
+
+#ifdef AVI_READER_TASK_SLOTS
+  avi_reader_stalls = 0;
+  avi_reader_stall_ms = 0;
+  avi_reader_max_stall_ms = 0;
+  avi_reader_depth_sum = 0;
+  avi_reader_depth_samples = 0;
+  avi_reader_min_depth = AVI_READER_TASK_SLOTS;
+  avi_reader_max_depth = 0;
+#endif // AVI_READER_TASK_SLOTS
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  avi_mjpeg_frames = 0;
+  avi_mjpeg_wait_ms = 0;
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
+}
+
 bool avi_open(char *avi_filename)
 {
   Serial.printf("avi_open(%s)\n", avi_filename);
+  unsigned long open_ms = millis();
+#ifdef AVI_STREAMING
+  avi = AVI_open_input_file(avi_filename, 0);
+#else
   avi = AVI_open_input_file(avi_filename, 1);
+#endif
+  open_ms = millis() - open_ms;
 
   if (!avi)
   {
     Serial.printf("AVI_open_input_file %s failed!\n", avi_filename);
     return false;
   }
+#ifdef AVI_STREAMING
+  Serial.printf("AVI_open_input_file: %lu ms, streaming without index\n", open_ms);
+#else
+  if (avi->video_super)
+  {
+    Serial.printf("AVI_open_input_file: %lu ms, OpenDML index segments: %ld\n", open_ms, avi->video_super->entries);
+  }
+  else
+  {
+    Serial.printf("AVI_open_input_file: %lu ms, idx1 entries: %ld (%0.0f entries/s)\n", open_ms, avi->n_idx, 1000.0 * avi->n_idx / max(open_ms, 1UL));
+  }
+#endif // AVI_STREAMING
+#ifdef AVI_INDEX_CACHE
+  Serial.printf("AVI index cache: %s (%s)\n", avi->index_cache_hit ? "hit" : "miss", avi->index_cache_file);
+#endif
 
   avi_total_frames = AVI_video_frames(avi);
   avi_w = AVI_video_width(avi);
@@ -151,36 +418,194 @@ bool avi_open(char *avi_filename)
   {
     avi_vcodec = UNKNOWN_CODEC_CODE;
   }
+  // MJPEG and Cinepak decoders need the whole frame in memory, grow vidbuf to fit the largest frame
+  avi_grow_vidbuf(0);
+
+#ifdef AVI_LOAD_TO_RAM_MAX
+  // short clips play from PSRAM, leave room for the frame buffers
+  long ram_budget = min((long)AVI_LOAD_TO_RAM_MAX, (long)heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) - 4 * estimateBufferSize);
+  unsigned long ram_ms = millis();
+  if (AVI_load_to_ram(avi, ram_budget) == 0)
+  {
+    Serial.printf("AVI_load_to_ram: %ld bytes, %lu ms\n", avi->ram_len, millis() - ram_ms);
+  }
+#endif // AVI_LOAD_TO_RAM_MAX
+#ifdef AVI_READ_AHEAD_SIZE
+  if (!avi->ram && (AVI_set_read_ahead(avi, AVI_READ_AHEAD_SIZE) != 0))
+  {
+    Serial.printf("AVI_set_read_ahead(%d) failed!\n", AVI_READ_AHEAD_SIZE);
+  }
+#endif
+
   Serial.printf("AVI avi_total_frames: %ld, %ld x %ld @ %.2f fps, format: %s, estimateBufferSize: %ld, ESP.getFreeHeap(): %ld, free PSRAM: %ld\n", avi_total_frames, avi_w, avi_h, avi_fr, avi_compressor, estimateBufferSize, (long)ESP.getFreeHeap(), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
 
+#ifdef CINEPAK_TRANSFORM
+  if (avi_vcodec == CINEPAK_CODEC_CODE)
+  {
+    // the blocks are written scaled and rotated, avi_w and avi_h are the output_buf frame size from here
+    uint16_t out_w = avi_w;
+    uint16_t out_h = avi_h;
+    cinepak.setTransform(AVI_CINEPAK_SCALE, AVI_CINEPAK_ROTATION);
+    cinepak.getOutputSize(&out_w, &out_h);
+    avi_w = out_w;
+    avi_h = out_h;
+    Serial.printf("Cinepak output: %ld x %ld\n", avi_w, avi_h);
+    if ((size_t)(avi_w * avi_h * 2) > output_buf_size)
+    {
+      Serial.printf("Cinepak output %ld x %ld does not fit output_buf!\n", avi_w, avi_h);
+      AVI_close(avi);
+      return false;
+    }
+  }
+#endif // CINEPAK_TRANSFORM
+
   avi_aChans = AVI_audio_channels(avi);
   avi_aBits = AVI_audio_bits(avi);
   avi_aFormat = AVI_audio_format(avi);
   avi_aRate = AVI_audio_rate(avi);
   avi_aBytes = AVI_audio_bytes(avi);
   avi_aChunks = AVI_audio_chunks(avi);
+  Serial.printf("Video index: %ld bytes (%0.2f bytes/frame)\n", AVI_video_index_bytes(avi), (float)AVI_video_index_bytes(avi) / avi_total_frames);
+
   Serial.printf("Audio channels: %ld, bits: %ld, format: %ld, rate: %ld, bytes: %ld, chunks: %ld\n", avi_aChans, avi_aBits, avi_aFormat, avi_aRate, avi_aBytes, avi_aChunks);
 
   avi_curr_frame = 0;
-  avi_skipped_frames = 0;
-
-  avi_total_read_video_ms = 0;
-  avi_total_decode_video_ms = 0;
-  avi_total_show_video_ms = 0;
+  avi_reset_stat();
 
 #ifdef AVI_SUPPORT_AUDIO
   audbuf_remain = 0;
-  avi_total_read_audio_ms = 0;
-  total_decode_audio_ms = 0;
-  total_play_audio_ms = 0;
 #endif // AVI_SUPPORT_AUDIO
 
+#ifdef AVI_STREAMING
+  avi_stream_vid_ready = false;
+  avi_stream_eof = false;
+  avi_stream_video_chunks = 0;
+  avi_stream_audio_chunks = 0;
+  avi_stream_dropped_chunks = 0;
+#ifdef AVI_SUPPORT_AUDIO
+  avi_stream_aud_len = 0;
+#endif // AVI_SUPPORT_AUDIO
+#endif // AVI_STREAMING
+
+#ifdef AVI_READER_TASK_SLOTS
+  if (!avi_reader_task_start())
+  {
+    AVI_close(avi);
+    return false;
+  }
+#endif // AVI_READER_TASK_SLOTS
+
   return true;
 }
 
+#ifdef AVI_STREAMING
+#ifdef AVI_SUPPORT_AUDIO
+// hand the staged audio chunk to the audio task once it has played the previous one
+bool avi_stream_pass_audio()
+{
+  if ((avi_stream_aud_len == 0) || (audbuf_remain > 0))
+  {
+    return false;
+  }
+  memcpy(audbuf, avi_stream_audbuf, avi_stream_aud_len);
+  audbuf_remain = avi_stream_aud_len;
+  avi_stream_aud_len = 0;
+  return true;
+}
+#endif // AVI_SUPPORT_AUDIO
+
+// demux the next video or audio chunk of the movi list, returns false at the end of file
+bool avi_stream_next()
+{
+  long len;
+  int ret;
+
+#ifdef AVI_SUPPORT_AUDIO
+  // only one audio chunk can be staged, wait for the audio task to take the last one
+  unsigned long wait_ms = millis();
+  while (!avi_stream_pass_audio() && (avi_stream_aud_len > 0))
+  {
+    if ((millis() - wait_ms) > SKIP_FRAME_TOLERANT_MS) // no audio task playing
+    {
+      avi_stream_aud_len = 0;
+      ++avi_stream_dropped_chunks;
+    }
+    else
+    {
+      vTaskDelay(pdMS_TO_TICKS(1));
+    }
+  }
+#endif // AVI_SUPPORT_AUDIO
+
+  while (!avi_stream_eof)
+  {
+    unsigned long curr_ms = millis();
+#ifdef AVI_SUPPORT_AUDIO
+    ret = AVI_read_data(avi, vidbuf, estimateBufferSize, avi_stream_audbuf, MAX_AUDIO_FRAME_SIZE, &len);
+#else
+    ret = AVI_read_data(avi, vidbuf, estimateBufferSize, NULL, 0, &len);
+#endif // AVI_SUPPORT_AUDIO
+    curr_ms = millis() - curr_ms;
+
+    if (ret == 1) // video
+    {
+      avi_total_read_video_ms += curr_ms;
+      ++avi_stream_video_chunks;
+      avi_stream_vid_len = len;
+      avi_stream_vid_ready = true;
+      return true;
+    }
+#ifdef AVI_SUPPORT_AUDIO
+    else if (ret == 2) // audio
+    {
+      avi_total_read_audio_ms += curr_ms;
+      ++avi_stream_audio_chunks;
+      avi_stream_aud_len = len;
+      avi_stream_pass_audio();
+      return true;
+    }
+#endif // AVI_SUPPORT_AUDIO
+    else if (ret == -1) // video chunk larger than vidbuf
+    {
+      Serial.printf("video_bytes(%ld) > estimateBufferSize(%ld)\n", len, estimateBufferSize);
+      avi_grow_vidbuf(len); // the chunk is passed already, the next ones this size fit
+      ++avi_stream_dropped_chunks;
+      ++avi_curr_frame;
+      ++avi_skipped_frames;
+    }
+    else if (ret == -2) // audio not supported, chunks larger than audbuf come in pieces
+    {
+#ifdef AVI_SUPPORT_AUDIO
+      ++avi_stream_dropped_chunks;
+#endif // AVI_SUPPORT_AUDIO
+    }
+    else if (ret == 0) // end of file
+    {
+      avi_stream_eof = true;
+    }
+  }
+  return false;
+}
+#endif // AVI_STREAMING
+
 #ifdef AVI_SUPPORT_AUDIO
 void avi_feed_audio()
 {
+#ifdef AVI_STREAMING
+  // demux until an audio chunk is staged or a video chunk is waiting for avi_decode()
+  while ((avi_stream_aud_len == 0) && !avi_stream_vid_ready && avi_stream_next())
+  {
+  }
+  avi_stream_pass_audio();
+  // the audio task runs while audbuf_read > 0, keep it running until the last chunk is played
+  audbuf_read = (avi_stream_eof && (avi_stream_aud_len == 0) && (audbuf_remain == 0)) ? 0 : MAX_AUDIO_FRAME_SIZE;
+#else
+#ifdef AVI_READER_TASK_SLOTS
+  if (avi_reader_task_handle && (xTaskGetCurrentTaskHandle() != avi_reader_task_handle)) // the reader task owns the file
+  {
+    return;
+  }
+#endif // AVI_READER_TASK_SLOTS
   if (audbuf_remain == 0)
   {
     unsigned long curr_ms = millis();
@@ -188,14 +613,515 @@ void avi_feed_audio()
     audbuf_remain = audbuf_read;
     avi_total_read_audio_ms += millis() - curr_ms;
   }
+#endif // AVI_STREAMING
 }
 #endif // AVI_SUPPORT_AUDIO
 
+#ifdef AVI_READER_TASK_SLOTS
+// grow a slot taken from the free queue to fit a frame of video_bytes or the largest frame known by now
+bool avi_reader_grow_slot(avi_reader_slot_t *slot, long video_bytes)
+{
+  long size = max(video_bytes, AVI_max_video_chunk(avi));
+  char *p = (char *)heap_caps_realloc(slot->buf, size, MALLOC_CAP_8BIT);
+  if (!p)
+  {
+    return false;
+  }
+  slot->buf = p;
+  slot->size = size;
+  return true;
+}
+
+// read the frames in order into free slots, and the audio, so the decoder never waits on the file
+void avi_reader_task(void *pvParam)
+{
+  long frame = avi_curr_frame;
+  uint8_t slot_num;
+
+  while (!avi_reader_stop)
+  {
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+    if (avi_reader_key_frame_from >= 0) // the keyframe bitset may page in an OpenDML segment
+    {
+      avi_reader_key_frame = AVI_next_key_frame(avi, avi_reader_key_frame_from);
+      avi_reader_key_frame_from = -1;
+    }
+#endif // AVI_CINEPAK_CATCH_UP_MS
+#ifdef AVI_SUPPORT_AUDIO
+    avi_feed_audio();
+#endif // AVI_SUPPORT_AUDIO
+
+    if (frame >= avi_total_frames)
+    {
+      vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    else if (xQueueReceive(avi_reader_free_queue, &slot_num, pdMS_TO_TICKS(1)) == pdTRUE)
+    {
+      avi_reader_slot_t *slot = &avi_reader_slots[slot_num];
+      unsigned long curr_ms = millis();
+      AVI_set_video_position(avi, frame);
+      slot->video_bytes = AVI_frame_size(avi, frame);
+      if (avi->ram)
+      {
+        slot->len = AVI_read_frame_ptr(avi, &slot->data, &slot->is_key_frame);
+      }
+      else if ((slot->video_bytes > slot->size) && !avi_reader_grow_slot(slot, slot->video_bytes))
+      {
+        slot->len = -1;
+      }
+      else
+      {
+        slot->data = slot->buf;
+        slot->len = AVI_read_frame(avi, slot->buf, &slot->is_key_frame);
+      }
+      avi_total_read_video_ms += millis() - curr_ms;
+      xQueueSend(avi_reader_ready_queue, &slot_num, portMAX_DELAY);
+      ++frame;
+    }
+  }
+
+  avi_reader_task_handle = NULL;
+  vTaskDelete(NULL);
+}
+
+bool avi_reader_task_start()
+{
+  avi_reader_slot_count = 0;
+  for (int i = 0; i < AVI_READER_TASK_SLOTS; ++i)
+  {
+    avi_reader_slots[i].buf = (i == 0) ? vidbuf : (char *)heap_caps_malloc(estimateBufferSize, MALLOC_CAP_8BIT);
+    avi_reader_slots[i].size = estimateBufferSize;
+    if (!avi_reader_slots[i].buf)
+    {
+      Serial.printf("avi_reader_slots[%d] heap_caps_malloc(%ld) failed!\n", i, estimateBufferSize);
+      break;
+    }
+    ++avi_reader_slot_count;
+  }
+  avi_reader_free_queue = xQueueCreate(AVI_READER_TASK_SLOTS, sizeof(uint8_t));
+  avi_reader_ready_queue = xQueueCreate(AVI_READER_TASK_SLOTS, sizeof(uint8_t));
+  for (uint8_t i = 0; i < avi_reader_slot_count; ++i)
+  {
+    xQueueSend(avi_reader_free_queue, &i, 0);
+  }
+  avi_reader_curr_slot = -1;
+  avi_reader_stop = false;
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+  avi_reader_key_frame_from = -1;
+#endif // AVI_CINEPAK_CATCH_UP_MS
+
+#ifdef AVI_SUPPORT_AUDIO
+  avi_feed_audio(); // first audio chunk for the audio task start, the reader task feeds the rest
+#endif // AVI_SUPPORT_AUDIO
+
+  BaseType_t ret_val = xTaskCreatePinnedToCore(
+      (TaskFunction_t)avi_reader_task,
+      (const char *const)"AVI Reader Task",
+      (const uint32_t)4096,
+      (void *const)NULL,
+      (UBaseType_t)configMAX_PRIORITIES - 2,
+      (TaskHandle_t *const)&avi_reader_task_handle,
+      (const BaseType_t)0);
+  if (ret_val != pdPASS)
+  {
+    Serial.printf("avi_reader_task start failed: %d\n", ret_val);
+    avi_reader_task_handle = NULL;
+    avi_reader_task_stop();
+    return false;
+  }
+  Serial.printf("AVI reader task: %ld slots of %ld bytes\n", avi_reader_slot_count, estimateBufferSize);
+  return true;
+}
+
+void avi_reader_task_stop()
+{
+  avi_reader_stop = true;
+  while (avi_reader_task_handle)
+  {
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  vQueueDelete(avi_reader_free_queue);
+  vQueueDelete(avi_reader_ready_queue);
+  vidbuf = avi_reader_slots[0].buf; // may have grown
+  estimateBufferSize = avi_reader_slots[0].size;
+  for (int i = 1; i < avi_reader_slot_count; ++i)
+  {
+    free(avi_reader_slots[i].buf);
+  }
+}
+
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+// the first keyframe at or after frame, looked up by the reader task as it owns the file
+long avi_reader_next_key_frame(long frame)
+{
+  avi_reader_key_frame_from = frame;
+  while (avi_reader_key_frame_from >= 0)
+  {
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  return avi_reader_key_frame;
+}
+#endif // AVI_CINEPAK_CATCH_UP_MS
+
+// hand the decoded frame buffer back to the reader task
+void avi_reader_release_slot()
+{
+  if (avi_reader_curr_slot >= 0)
+  {
+    uint8_t slot_num = avi_reader_curr_slot;
+    xQueueSend(avi_reader_free_queue, &slot_num, 0);
+    avi_reader_curr_slot = -1;
+  }
+}
+#endif // AVI_READER_TASK_SLOTS
+
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+// Cinepak delta frames build on the frames before them, so a lagging play
+// jumps to the next keyframe and leaves the frames before it unread, the
+// last shown frame stays till the keyframe is due
+void avi_catch_up()
+{
+  if (millis() < avi_start_ms + (unsigned long)(avi_curr_frame * 1000 / avi_fr) + AVI_CINEPAK_CATCH_UP_MS)
+  {
+    return;
+  }
+#ifdef AVI_READER_TASK_SLOTS
+  long key_frame = avi_reader_next_key_frame(avi_curr_frame);
+#else
+  long key_frame = AVI_next_key_frame(avi, avi_curr_frame);
+#endif // AVI_READER_TASK_SLOTS
+  if (key_frame <= avi_curr_frame) // no later keyframe, or this frame is one
+  {
+    return;
+  }
+
+  ++avi_catch_ups;
+  avi_catch_up_frames += key_frame - avi_curr_frame;
+  avi_skipped_frames += key_frame - avi_curr_frame;
+#ifdef AVI_READER_TASK_SLOTS
+  avi_reader_task_stop();
+#endif // AVI_READER_TASK_SLOTS
+  avi_curr_frame = key_frame;
+#ifdef AVI_READER_TASK_SLOTS
+  if (!avi_reader_task_start())
+  {
+    avi_curr_frame = avi_total_frames; // no reader, end the play loop
+  }
+#endif // AVI_READER_TASK_SLOTS
+}
+#endif // AVI_CINEPAK_CATCH_UP_MS
+
+#ifdef AVI_SUPPORT_MJPEG
+void avi_mjpeg_decode_frame(int decoder, char *data, long len, uint16_t *out)
+{
+#if defined(ESP32) && (CONFIG_IDF_TARGET_ESP32P4)
+  uint32_t out_size;
+  jpeg_decode_cfg_t decode_cfg_rgb = {
+      .output_format = JPEG_DECODE_OUT_FORMAT_RGB565,
+      .rgb_order = JPEG_DEC_RGB_ELEMENT_ORDER_BGR,
+  };
+  ESP_ERROR_CHECK(jpeg_decoder_process(decoder_engine, &decode_cfg_rgb, (const uint8_t *)data, len, (uint8_t *)out, output_buf_size, &out_size));
+#else
+  jpeg_io[decoder]->inbuf = (uint8_t *)data;
+  jpeg_io[decoder]->inbuf_len = len;
+
+  jpeg_dec_parse_header(jpeg_dec[decoder], jpeg_io[decoder], out_info[decoder]);
+
+  jpeg_io[decoder]->outbuf = (uint8_t *)out;
+
+  jpeg_dec_process(jpeg_dec[decoder], jpeg_io[decoder]);
+#endif
+}
+
+#ifdef AVI_MJPEG_PIPELINE
+// decode the submitted frames, one task per worker: core 0 and with
+// AVI_MJPEG_FRAME_PARALLEL core 1 too, ESP32-P4 hands them on to the JPEG engine
+void avi_mjpeg_task(void *pvParam)
+{
+  avi_mjpeg_worker_t *w = (avi_mjpeg_worker_t *)pvParam;
+  while (1)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    unsigned long curr_ms = millis();
+    avi_mjpeg_decode_frame(w - avi_mjpeg_workers, w->data, w->len, w->out);
+    w->decode_ms = millis() - curr_ms;
+    w->done = true;
+    xTaskNotifyGive(avi_mjpeg_caller_task);
+  }
+}
+
+bool avi_mjpeg_task_start()
+{
+  avi_mjpeg_vidbuf_size = estimateBufferSize;
+  avi_mjpeg_head = 0;
+  avi_mjpeg_in_flight = 0;
+  for (int i = 0; i < AVI_MJPEG_WORKERS; ++i)
+  {
+    avi_mjpeg_worker_t *w = &avi_mjpeg_workers[i];
+    avi_mjpeg_vidbufs[i] = (char *)heap_caps_malloc(avi_mjpeg_vidbuf_size, MALLOC_CAP_8BIT);
+    if (!avi_mjpeg_vidbufs[i])
+    {
+      Serial.println("avi_mjpeg_vidbufs heap_caps_malloc failed!");
+      return false;
+    }
+    w->out = (uint16_t *)aligned_alloc(16, output_buf_size);
+    if (!w->out)
+    {
+      Serial.println("avi_mjpeg_workers out aligned_alloc failed!");
+      return false;
+    }
+    w->data = NULL;
+    w->pending = false;
+
+    // the core 1 worker shares the core with the play loop at its priority, so reading and drawing carry on
+    BaseType_t ret_val = xTaskCreatePinnedToCore(
+        (TaskFunction_t)avi_mjpeg_task,
+        (const char *const)"AVI MJPEG Task",
+        (const uint32_t)4096,
+        (void *const)w,
+        (UBaseType_t)((i == 0) ? (configMAX_PRIORITIES - 3) : (tskIDLE_PRIORITY + 1)),
+        (TaskHandle_t *const)&w->task_handle,
+        (const BaseType_t)i);
+    if (ret_val != pdPASS)
+    {
+      Serial.printf("avi_mjpeg_task start failed: %d\n", ret_val);
+      return false;
+    }
+  }
+  return true;
+}
+
+// hand a frame to the next worker in turn, it decodes into its own back buffer
+void avi_mjpeg_submit(char *data, long len)
+{
+  avi_mjpeg_worker_t *w = &avi_mjpeg_workers[(avi_mjpeg_head + avi_mjpeg_in_flight) % AVI_MJPEG_WORKERS];
+  w->data = data;
+  w->len = len;
+  w->done = false;
+  w->pending = true;
+  avi_mjpeg_caller_task = xTaskGetCurrentTaskHandle();
+  ++avi_mjpeg_in_flight;
+  xTaskNotifyGive(w->task_handle);
+}
+
+// wait for the oldest frame in flight and take it, returns its worker or NULL if none;
+// taking the frames in submit order puts them back in order whichever worker finishes first
+avi_mjpeg_worker_t *avi_mjpeg_wait()
+{
+  if (avi_mjpeg_in_flight == 0)
+  {
+    return NULL;
+  }
+  avi_mjpeg_worker_t *w = &avi_mjpeg_workers[avi_mjpeg_head];
+  unsigned long curr_ms = millis();
+  while (!w->done) // a notify may come from the other worker
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  avi_mjpeg_wait_ms += millis() - curr_ms;
+  avi_total_decode_video_ms += w->decode_ms;
+  w->pending = false;
+  avi_mjpeg_head = (avi_mjpeg_head + 1) % AVI_MJPEG_WORKERS;
+  --avi_mjpeg_in_flight;
+  return w;
+}
+
+// wait for the frames in flight and drop them
+void avi_mjpeg_flush()
+{
+  while (avi_mjpeg_wait())
+  {
+  }
+}
+
+bool avi_mjpeg_vidbuf_busy(char *buf)
+{
+  for (int i = 0; i < AVI_MJPEG_WORKERS; ++i)
+  {
+    if (avi_mjpeg_workers[i].pending && (avi_mjpeg_workers[i].data == buf))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// read a frame into a read buffer no worker is decoding from,
+// returns the length, -1 if the frame is larger than the buffers
+long avi_mjpeg_read(long frame, char **data)
+{
+  AVI_set_video_position(avi, frame);
+
+  long video_bytes = AVI_frame_size(avi, frame);
+  if ((video_bytes > estimateBufferSize) && !avi->ram)
+  {
+    if (avi_mjpeg_in_flight > 0) // the read buffers grow once the workers are done with them, the restart reads this frame again
+    {
+      return -1;
+    }
+    if (!avi_grow_vidbuf(video_bytes))
+    {
+      Serial.printf("video_bytes(%ld) > estimateBufferSize(%ld)\n", video_bytes, estimateBufferSize);
+      return -1;
+    }
+  }
+
+  unsigned long curr_ms = millis();
+  long len;
+  if (avi->ram)
+  {
+    len = AVI_read_frame_ptr(avi, data, &avi_curr_is_key_frame);
+  }
+  else
+  {
+    *data = vidbuf;
+    for (int i = 0; avi_mjpeg_vidbuf_busy(*data); ++i)
+    {
+      *data = avi_mjpeg_vidbufs[i];
+    }
+    len = AVI_read_frame(avi, *data, &avi_curr_is_key_frame);
+  }
+  avi_total_read_video_ms += millis() - curr_ms;
+  return len;
+}
+
+// The current frame is on a worker already unless the pipeline restarts
+// (first frame, seek, lag). Idle workers get the frames after it, with all
+// busy one more frame is read while they decode. The decoded back buffer of
+// the current frame becomes output_buf, then the frame read ahead is handed over.
+bool avi_mjpeg_pipeline_decode()
+{
+  char *data;
+  long len;
+
+  if (avi_mjpeg_in_flight == 0)
+  {
+    if (millis() >= avi_skip_frame_ms)
+    {
+      ++avi_curr_frame;
+      ++avi_skipped_frames;
+      return false;
+    }
+    len = avi_mjpeg_read(avi_curr_frame, &data);
+    if (len < 0)
+    {
+      ++avi_curr_frame;
+      ++avi_skipped_frames;
+      return false;
+    }
+    if (len == 0) // empty chunk, the last frame stays
+    {
+      ++avi_curr_frame;
+      return true;
+    }
+    avi_mjpeg_submit(data, len);
+  }
+
+  len = 0;
+  while (1)
+  {
+    long next_frame = avi_curr_frame + avi_mjpeg_in_flight;
+    unsigned long next_skip_frame_ms = avi_start_ms + ((next_frame + 1) * 1000 / avi_fr) + SKIP_FRAME_TOLERANT_MS;
+    if ((next_frame >= avi_total_frames) || (millis() >= next_skip_frame_ms)) // a lagging next frame is skipped unread
+    {
+      break;
+    }
+    len = avi_mjpeg_read(next_frame, &data);
+    if ((len <= 0) || (avi_mjpeg_in_flight == AVI_MJPEG_WORKERS)) // empty and oversized frames go through a restart
+    {
+      break;
+    }
+    avi_mjpeg_submit(data, len);
+    len = 0;
+  }
+
+  avi_mjpeg_worker_t *w = avi_mjpeg_wait();
+  uint16_t *p = output_buf;
+  output_buf = w->out;
+  w->out = p;
+  ++avi_mjpeg_frames;
+
+  if (len > 0)
+  {
+    avi_mjpeg_submit(data, len);
+  }
+
+  ++avi_curr_frame;
+  return true;
+}
+#endif // AVI_MJPEG_PIPELINE
+#endif // AVI_SUPPORT_MJPEG
+
 bool avi_decode()
 {
+  unsigned long curr_ms;
+  char *frame_buf = vidbuf;
+
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+  if (avi_vcodec == CINEPAK_CODEC_CODE)
+  {
+    avi_catch_up();
+  }
+  if (avi_curr_frame >= avi_total_frames)
+  {
+    return false;
+  }
+#endif // AVI_CINEPAK_CATCH_UP_MS
+
   avi_next_frame_ms = avi_start_ms + ((avi_curr_frame + 1) * 1000 / avi_fr);
   avi_skip_frame_ms = avi_next_frame_ms + SKIP_FRAME_TOLERANT_MS;
 
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  if (avi_vcodec == MJPEG_CODEC_CODE)
+  {
+    return avi_mjpeg_pipeline_decode();
+  }
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
+
+#ifdef AVI_STREAMING
+  // chunks come in file order, a lagging MJPEG frame is still read to keep the reads sequential
+  while (!avi_stream_vid_ready)
+  {
+    if (!avi_stream_next())
+    {
+      avi_total_frames = avi_curr_frame; // end of movi, the header count may be off
+      return false;
+    }
+  }
+  frame_buf = vidbuf; // may have grown in avi_stream_next()
+  actual_video_size = avi_stream_vid_len;
+  avi_stream_vid_ready = false;
+  avi_curr_is_key_frame = 1; // unknown without index
+#elif defined(AVI_READER_TASK_SLOTS)
+  avi_reader_release_slot();
+  long depth = uxQueueMessagesWaiting(avi_reader_ready_queue);
+  avi_reader_depth_sum += depth;
+  ++avi_reader_depth_samples;
+  avi_reader_min_depth = min(avi_reader_min_depth, depth);
+  avi_reader_max_depth = max(avi_reader_max_depth, depth);
+  uint8_t slot_num;
+  if (xQueueReceive(avi_reader_ready_queue, &slot_num, 0) != pdTRUE)
+  {
+    curr_ms = millis();
+    xQueueReceive(avi_reader_ready_queue, &slot_num, portMAX_DELAY);
+    curr_ms = millis() - curr_ms;
+    ++avi_reader_stalls;
+    avi_reader_stall_ms += curr_ms;
+    avi_reader_max_stall_ms = max(avi_reader_max_stall_ms, curr_ms);
+  }
+  avi_reader_curr_slot = slot_num;
+  if (avi_reader_slots[slot_num].len < 0)
+  {
+    Serial.printf("video_bytes(%ld) > avi_reader_slots[%d].size(%ld)\n", avi_reader_slots[slot_num].video_bytes, slot_num, avi_reader_slots[slot_num].size);
+    ++avi_curr_frame;
+    ++avi_skipped_frames;
+    return false;
+  }
+  frame_buf = avi_reader_slots[slot_num].data;
+  actual_video_size = avi_reader_slots[slot_num].len;
+  avi_curr_is_key_frame = avi_reader_slots[slot_num].is_key_frame;
+#endif // AVI_STREAMING
+
 #ifdef AVI_SUPPORT_MJPEG
   if (
       (avi_vcodec == MJPEG_CODEC_CODE) && (millis() >= avi_skip_frame_ms) // MJPEG can direct skip decode frame
@@ -206,72 +1132,191 @@ bool avi_decode()
     ++avi_skipped_frames;
     return false;
   }
+#endif // AVI_SUPPORT_MJPEG
+
+#if !defined(AVI_STREAMING) && !defined(AVI_READER_TASK_SLOTS)
+  AVI_set_video_position(avi, avi_curr_frame);
+
+  long video_bytes = AVI_frame_size(avi, avi_curr_frame);
+  if ((video_bytes > estimateBufferSize) && !avi->ram && !avi_grow_vidbuf(video_bytes)) // frames in the RAM image are not copied to vidbuf
+  {
+    Serial.printf("video_bytes(%ld) > estimateBufferSize(%ld)\n", video_bytes, estimateBufferSize);
+    ++avi_curr_frame;
+    ++avi_skipped_frames;
+    return false;
+  }
+
+  curr_ms = millis();
+  if (avi->ram)
+  {
+    actual_video_size = AVI_read_frame_ptr(avi, &frame_buf, &avi_curr_is_key_frame);
+  }
   else
+  {
+    frame_buf = vidbuf; // may have grown above
+    actual_video_size = AVI_read_frame(avi, frame_buf, &avi_curr_is_key_frame);
+  }
+  avi_total_read_video_ms += millis() - curr_ms;
+#ifdef AVI_SUPPORT_AUDIO
+  // Serial.printf("frame: %ld, avi_curr_is_key_frame: %ld, video_bytes: %ld, actual_video_size: %ld, audio_bytes: %ld, ESP.getFreeHeap(): %ld\n", avi_curr_frame, avi_curr_is_key_frame, video_bytes, actual_video_size, audio_bytes, (long)ESP.getFreeHeap());
+#else
+  // Serial.printf("frame: %ld, avi_curr_is_key_frame: %ld, video_bytes: %ld, actual_video_size: %ld, ESP.getFreeHeap(): %ld\n", avi_curr_frame, avi_curr_is_key_frame, video_bytes, actual_video_size, (long)ESP.getFreeHeap());
+#endif
+#endif // !AVI_STREAMING && !AVI_READER_TASK_SLOTS
+
+  curr_ms = millis();
+  if (actual_video_size > 0)
+  {
+    if (avi_vcodec == UNKNOWN_CODEC_CODE)
+    {
+    }
+#ifdef AVI_SUPPORT_CINEPAK
+    else if (avi_vcodec == CINEPAK_CODEC_CODE)
+    {
+      cinepak.decodeFrame((uint8_t *)frame_buf, actual_video_size, output_buf, output_buf_size);
+    }
+#endif // AVI_SUPPORT_CINEPAK
+#ifdef AVI_SUPPORT_MJPEG
+    else if (avi_vcodec == MJPEG_CODEC_CODE)
+    {
+      avi_mjpeg_decode_frame(0, frame_buf, actual_video_size, output_buf);
+    }
 #endif // AVI_SUPPORT_MJPEG
+  }
+  avi_total_decode_video_ms += millis() - curr_ms;
+#ifdef AVI_READER_TASK_SLOTS
+  avi_reader_release_slot();
+#endif // AVI_READER_TASK_SLOTS
+
+  ++avi_curr_frame;
+  return true;
+}
+
+#ifndef AVI_STREAMING
+// jump to frame, Cinepak decodes forward from the preceding keyframe without showing the frames in between
+bool avi_seek_frame(long frame)
+{
+  avi_seek_start_ms = millis();
+  if (frame >= avi_total_frames)
+  {
+    frame = avi_total_frames - 1;
+  }
+  if (frame < 0)
   {
-    AVI_set_video_position(avi, avi_curr_frame);
+    frame = 0;
+  }
+
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  avi_mjpeg_flush();
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
 
-    long video_bytes = AVI_frame_size(avi, avi_curr_frame);
-    if (video_bytes > estimateBufferSize)
+#ifdef AVI_READER_TASK_SLOTS
+  avi_reader_task_stop(); // the keyframe lookup may page in an OpenDML index segment, the reader owns the file till now
+#endif // AVI_READER_TASK_SLOTS
+
+  long key_frame = frame;
+#ifdef AVI_SUPPORT_CINEPAK
+  if (avi_vcodec == CINEPAK_CODEC_CODE)
+  {
+    key_frame = AVI_prev_key_frame(avi, frame);
+    if (key_frame < 0)
     {
-      Serial.printf("video_bytes(%ld) > estimateBufferSize(%ld)\n", video_bytes, estimateBufferSize);
-      ++avi_curr_frame;
-      ++avi_skipped_frames;
+      Serial.printf("AVI_prev_key_frame(%ld) failed!\n", frame);
+#ifdef AVI_READER_TASK_SLOTS
+      if (!avi_reader_task_start()) // play on from where it was
+      {
+        avi_curr_frame = avi_total_frames; // no reader, end the play loop
+      }
+#endif // AVI_READER_TASK_SLOTS
       return false;
     }
-    else
-    {
-      unsigned long curr_ms = millis();
-      actual_video_size = AVI_read_frame(avi, vidbuf, &avi_curr_is_key_frame);
-      avi_total_read_video_ms += millis() - curr_ms;
-#ifdef AVI_SUPPORT_AUDIO
-      // Serial.printf("frame: %ld, avi_curr_is_key_frame: %ld, video_bytes: %ld, actual_video_size: %ld, audio_bytes: %ld, ESP.getFreeHeap(): %ld\n", avi_curr_frame, avi_curr_is_key_frame, video_bytes, actual_video_size, audio_bytes, (long)ESP.getFreeHeap());
-#else
-      // Serial.printf("frame: %ld, avi_curr_is_key_frame: %ld, video_bytes: %ld, actual_video_size: %ld, ESP.getFreeHeap(): %ld\n", avi_curr_frame, avi_curr_is_key_frame, video_bytes, actual_video_size, (long)ESP.getFreeHeap());
-#endif
+  }
+#endif // AVI_SUPPORT_CINEPAK
 
-      curr_ms = millis();
+#ifdef AVI_SUPPORT_CINEPAK
+  int is_key_frame;
+  for (long i = key_frame; i < frame; ++i)
+  {
+    AVI_set_video_position(avi, i);
+    long video_bytes = AVI_frame_size(avi, i);
+    if ((video_bytes <= estimateBufferSize) || avi_grow_vidbuf(video_bytes)) // a frame left out breaks the codebooks of the ones after it
+    {
+      actual_video_size = AVI_read_frame(avi, vidbuf, &is_key_frame);
       if (actual_video_size > 0)
       {
-        if (avi_vcodec == UNKNOWN_CODEC_CODE)
-        {
-        }
-#ifdef AVI_SUPPORT_CINEPAK
-        else if (avi_vcodec == CINEPAK_CODEC_CODE)
-        {
-          cinepak.decodeFrame((uint8_t *)vidbuf, actual_video_size, output_buf, output_buf_size);
-        }
+        cinepak.decodeFrame((uint8_t *)vidbuf, actual_video_size, output_buf, output_buf_size);
+      }
+    }
+    ++avi_seek_decoded_frames;
+  }
 #endif // AVI_SUPPORT_CINEPAK
-#ifdef AVI_SUPPORT_MJPEG
-#if defined(ESP32) && (CONFIG_IDF_TARGET_ESP32P4)
-        uint32_t out_size;
-        jpeg_decode_cfg_t decode_cfg_rgb = {
-            .output_format = JPEG_DECODE_OUT_FORMAT_RGB565,
-            .rgb_order = JPEG_DEC_RGB_ELEMENT_ORDER_BGR,
-        };
-        ESP_ERROR_CHECK(jpeg_decoder_process(decoder_engine, &decode_cfg_rgb, (const uint8_t *)vidbuf, actual_video_size, (uint8_t *)output_buf, output_buf_size, &out_size));
-#else
-        else if (avi_vcodec == MJPEG_CODEC_CODE)
-        {
-          jpeg_io->inbuf = (uint8_t *)vidbuf;
-          jpeg_io->inbuf_len = actual_video_size;
 
-          jpeg_dec_parse_header(jpeg_dec, jpeg_io, out_info);
+#ifdef AVI_SUPPORT_AUDIO
+  // audio already handed to the audio task still plays, the next read starts at the new position
+  if (avi_aBytes > 0)
+  {
+    AVI_set_audio_position_aligned(avi, (long)((double)avi_aBytes * frame / avi_total_frames));
+  }
+#endif // AVI_SUPPORT_AUDIO
+
+  avi_curr_frame = frame;
+  avi_start_ms = millis() - (unsigned long)(frame * 1000 / avi_fr);
+  ++avi_seeks;
+  avi_seek_pending = true;
 
-          jpeg_io->outbuf = (uint8_t *)output_buf;
+#ifdef AVI_READER_TASK_SLOTS
+  if (!avi_reader_task_start())
+  {
+    avi_curr_frame = avi_total_frames; // no reader, end the play loop
+    return false;
+  }
+#endif // AVI_READER_TASK_SLOTS
+
+  return true;
+}
 
-          jpeg_dec_process(jpeg_dec, jpeg_io);
+bool avi_seek_ms(unsigned long ms)
+{
+  return avi_seek_frame(ms * avi_fr / 1000);
+}
+#endif // !AVI_STREAMING
+
+#ifdef CINEPAK_DIRTY_BLOCKS
+// push the regions changed since the last shown frame, skipped frames add to them
+void avi_draw_dirty(int x, int y)
+{
+  uint16_t n = cinepak.getDirtyRects(avi_dirty_rects, AVI_MAX_DIRTY_RECTS);
+  for (uint16_t i = 0; i < n; ++i)
+  {
+    CinepakRect *r = &avi_dirty_rects[i];
+    uint16_t *p = output_buf + (r->y * avi_w) + r->x;
+    if (r->w == avi_w) // full rows are contiguous in output_buf
+    {
+      gfx->draw16bitBeRGBBitmap(x + r->x, y + r->y, p, r->w, r->h);
+    }
+    else
+    {
+      // the display takes no stride, pack as many rows as avi_dirty_buf holds
+      uint16_t rows = AVI_DIRTY_BUF_PIXELS / r->w;
+      for (uint16_t j = 0; j < r->h; j += rows)
+      {
+        uint16_t h = ((r->h - j) < rows) ? (r->h - j) : rows;
+        uint16_t *d = avi_dirty_buf;
+        for (uint16_t k = 0; k < h; ++k)
+        {
+          memcpy(d, p, r->w * 2);
+          d += r->w;
+          p += avi_w;
         }
-#endif
-#endif // AVI_SUPPORT_MJPEG
+        gfx->draw16bitBeRGBBitmap(x + r->x, y + r->y + j, avi_dirty_buf, r->w, h);
       }
-      avi_total_decode_video_ms += millis() - curr_ms;
-
-      ++avi_curr_frame;
-      return true;
     }
+    avi_show_bytes += r->w * r->h * 2;
   }
+  avi_show_rects += n;
+  cinepak.clearDirty();
 }
+#endif // CINEPAK_DIRTY_BLOCKS
 
 void avi_draw(int x, int y)
 {
@@ -284,8 +1329,21 @@ void avi_draw(int x, int y)
 #else
 #ifdef CANVAS_R1
     g->draw16bitBeRGBBitmapR1(x, y, output_buf, avi_w, avi_h);
+#else
+#ifdef CINEPAK_DIRTY_BLOCKS
+    if (avi_vcodec == CINEPAK_CODEC_CODE)
+    {
+      avi_draw_dirty(x, y);
+    }
+    else
+    {
+      gfx->draw16bitBeRGBBitmap(x, y, output_buf, avi_w, avi_h);
+      avi_show_bytes += avi_w * avi_h * 2;
+    }
+    ++avi_show_frames;
 #else
     gfx->draw16bitBeRGBBitmap(x, y, output_buf, avi_w, avi_h);
+#endif // CINEPAK_DIRTY_BLOCKS
 #endif // #ifdef CANVAS_R1
 #ifdef CANVAS
     gfx->flush();
@@ -293,6 +1351,14 @@ void avi_draw(int x, int y)
 #endif // #if defined(RGB_PANEL) | defined(DSI_PANEL)
     avi_total_show_video_ms += millis() - curr_ms;
 
+    if (avi_seek_pending)
+    {
+      curr_ms = millis() - avi_seek_start_ms;
+      avi_total_seek_ms += curr_ms;
+      avi_max_seek_ms = max(avi_max_seek_ms, curr_ms);
+      avi_seek_pending = false;
+    }
+
     while (millis() < avi_next_frame_ms)
     {
       vTaskDelay(pdMS_TO_TICKS(1));
@@ -307,10 +1373,54 @@ void avi_draw(int x, int y)
 
 void avi_close()
 {
+#ifdef AVI_READER_TASK_SLOTS
+  avi_reader_task_stop();
+#endif // AVI_READER_TASK_SLOTS
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  avi_mjpeg_flush();
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
+  if (avi->video_index)
+  {
+    avi_video_index_lookups = avi->video_index->lookups;
+    avi_video_index_steps = avi->video_index->steps;
+  }
+  avi_index_segment_loads = AVI_index_segment_loads(avi);
+  avi_read_ahead_hits = avi_read_ahead_misses = avi_read_ahead_fills = avi_read_ahead_bytes = 0;
+  if (avi->read_ahead)
+  {
+    avi_read_ahead_hits = avi->read_ahead->hits;
+    avi_read_ahead_misses = avi->read_ahead->misses;
+    avi_read_ahead_fills = avi->read_ahead->fills + avi->read_ahead->direct;
+    avi_read_ahead_bytes = avi->read_ahead->bytes;
+  }
   AVI_close(avi);
+  // the next file grows the buffers to its own largest frame, its reader slots and RAM budget follow
+  if (estimateBufferSize > avi_init_buffer_size)
+  {
+    char *p = (char *)heap_caps_realloc(vidbuf, avi_init_buffer_size, MALLOC_CAP_8BIT);
+    if (p)
+    {
+      vidbuf = p;
+    }
+    estimateBufferSize = avi_init_buffer_size; // a buffer that did not shrink holds that still
+  }
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  if (avi_mjpeg_vidbuf_size > avi_init_buffer_size)
+  {
+    for (int i = 0; i < AVI_MJPEG_WORKERS; ++i)
+    {
+      char *p = (char *)heap_caps_realloc(avi_mjpeg_vidbufs[i], avi_init_buffer_size, MALLOC_CAP_8BIT);
+      if (p)
+      {
+        avi_mjpeg_vidbufs[i] = p;
+      }
+    }
+    avi_mjpeg_vidbuf_size = avi_init_buffer_size;
+  }
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
   // if (avi_vcodec == MJPEG_CODEC_CODE)
   // {
-  //   jpeg_dec_close(jpeg_dec);
+  //   jpeg_dec_close(jpeg_dec[0]);
   // }
 #ifdef AVI_SUPPORT_AUDIO
   audbuf_read = 0;
@@ -331,6 +1441,43 @@ void avi_show_stat()
   Serial.printf("Read video: %lu ms (%0.1f %%)\n", avi_total_read_video_ms, 100.0 * avi_total_read_video_ms / time_used);
   Serial.printf("Decode video: %lu ms (%0.1f %%)\n", avi_total_decode_video_ms, 100.0 * avi_total_decode_video_ms / time_used);
   Serial.printf("Show video: %lu ms (%0.1f %%)\n", avi_total_show_video_ms, 100.0 * avi_total_show_video_ms / time_used);
+  Serial.printf("Video index lookups: %lu, walked frames: %lu (%0.2f per lookup)\n", avi_video_index_lookups, avi_video_index_steps, (float)avi_video_index_steps / max(avi_video_index_lookups, 1UL));
+  Serial.printf("OpenDML index segments loaded: %ld\n", avi_index_segment_loads);
+#ifdef AVI_READ_AHEAD_SIZE
+  Serial.printf("Read-ahead hits: %lu, misses: %lu (%0.1f %% hit), file reads: %lu, %lu bytes\n", avi_read_ahead_hits, avi_read_ahead_misses, 100.0 * avi_read_ahead_hits / max(avi_read_ahead_hits + avi_read_ahead_misses, 1UL), avi_read_ahead_fills, avi_read_ahead_bytes);
+#endif
+#ifdef CINEPAK_DIRTY_BLOCKS
+  Serial.printf("Show video bus bytes: %lu per frame (%0.1f %% of full frames), rects: %0.1f per frame\n", avi_show_bytes / max(avi_show_frames, 1UL), 100.0 * avi_show_bytes / max(avi_show_frames * avi_w * avi_h * 2, 1UL), (float)avi_show_rects / max(avi_show_frames, 1UL));
+#endif // CINEPAK_DIRTY_BLOCKS
+  if (avi_seeks > 0)
+  {
+    Serial.printf("Seeks: %lu, decoded forward: %lu frames, seek to first frame: avg %0.1f ms, max %lu ms\n", avi_seeks, avi_seek_decoded_frames, (float)avi_total_seek_ms / avi_seeks, avi_max_seek_ms);
+  }
+#ifdef AVI_CINEPAK_CATCH_UP_MS
+  if (avi_catch_ups > 0)
+  {
+    Serial.printf("Cinepak catch-ups: %lu, dropped frames: %lu unread\n", avi_catch_ups, avi_catch_up_frames);
+  }
+#endif // AVI_CINEPAK_CATCH_UP_MS
+#if defined(AVI_SUPPORT_CINEPAK) && defined(CINEPAK_PARALLEL)
+  if (avi_vcodec == CINEPAK_CODEC_CODE)
+  {
+    Serial.printf("Cinepak worker stack: %lu bytes never used\n", (unsigned long)cinepak.getWorkerStackFree());
+  }
+#endif // AVI_SUPPORT_CINEPAK && CINEPAK_PARALLEL
+#ifdef AVI_READER_TASK_SLOTS
+  Serial.printf("Reader queue: %ld slots, depth avg: %0.1f, min: %ld, max: %ld\n", avi_reader_slot_count, (float)avi_reader_depth_sum / max(avi_reader_depth_samples, 1UL), avi_reader_min_depth, avi_reader_max_depth);
+  Serial.printf("Decoder stalls: %lu, %lu ms (longest %lu ms)\n", avi_reader_stalls, avi_reader_stall_ms, avi_reader_max_stall_ms);
+#endif // AVI_READER_TASK_SLOTS
+#if defined(AVI_SUPPORT_MJPEG) && defined(AVI_MJPEG_PIPELINE)
+  if (avi_mjpeg_frames > 0)
+  {
+    Serial.printf("MJPEG pipeline: %lu frames on %d workers, the play loop waited %lu ms of the %lu ms decode\n", avi_mjpeg_frames, AVI_MJPEG_WORKERS, avi_mjpeg_wait_ms, avi_total_decode_video_ms);
+  }
+#endif // AVI_SUPPORT_MJPEG && AVI_MJPEG_PIPELINE
+#ifdef AVI_STREAMING
+  Serial.printf("Streamed chunks: video %lu, audio %lu, dropped %lu\n", avi_stream_video_chunks, avi_stream_audio_chunks, avi_stream_dropped_chunks);
+#endif // AVI_STREAMING
 #ifdef AVI_SUPPORT_AUDIO
   Serial.printf("Read audio: %lu ms (%0.1f %%)\n", avi_total_read_audio_ms, 100.0 * avi_total_read_audio_ms / time_used);
   Serial.printf("Decode audio: %lu ms (%0.1f %%)\n", total_decode_audio_ms, 100.0 * total_decode_audio_ms / time_used);
@@ -46,8 +46,43 @@ const char *avi_folder = "/avi";
 #define AVI_SUPPORT_AUDIO
 #endif
 
+// keep the decoded AVI index in a sidecar file (<filename>.idx) for faster reopen
+// #define AVI_INDEX_CACHE
+
+// play the movi list in file order without loading the index, starts at once and reads sequentially
+// #define AVI_STREAMING
+
+// read the compressed frames ahead on a separate task, decoding then does not wait on the SD card
+// #define AVI_READER_TASK_SLOTS 3
+
+// copy short clips into PSRAM, looping them again with avi_seek_frame(0) does not touch the file system
+// #define AVI_LOAD_TO_RAM_MAX (4 * 1024 * 1024)
+
+// play each clip this many times before the next one, replaying with avi_seek_frame(0) and the audio task held, the stats are of the last time
+// #define AVI_LOOP_COUNT 3
+
+// decode the strips of a Cinepak frame on both cores, needs content encoded with more than one strip
+// #define CINEPAK_PARALLEL
+
+// decode MJPEG on a worker task into a back buffer, reading the next frame and showing the last one meanwhile
+// #define AVI_MJPEG_PIPELINE
+
+// the MJPEG pipeline with a decode worker on each core, for content the single worker cannot keep up with
+// #define AVI_MJPEG_FRAME_PARALLEL
+
+// when Cinepak playback lags this far behind, drop the frames up to the next keyframe to catch up
+// #define AVI_CINEPAK_CATCH_UP_MS 500
+
+// scale and rotate Cinepak frames while decoding, e.g. for a panel in portrait orientation, replaces the CANVAS_R1 pass
+// #define AVI_CINEPAK_SCALE CINEPAK_SCALE_2
+// #define AVI_CINEPAK_ROTATION 1
+
 #include "AviFunc.h"
 
+#if defined(AVI_LOOP_COUNT) && defined(AVI_STREAMING)
+#error "AVI_LOOP_COUNT replays with avi_seek_frame(0), it cannot be used with AVI_STREAMING"
+#endif
+
 #ifdef AVI_SUPPORT_AUDIO
 #include "esp32_audio.h"
 #endif
@@ -179,7 +214,7 @@ void loop()
       {
         std::string s = file.name();
         // if ((!s.starts_with(".")) && (s.ends_with(".avi")))
-        if ((s.rfind(".", 0) != 0) && ((int)s.find(".avi", 0) > 0))
+        if ((s.rfind(".", 0) != 0) && (s.length() > 4) && (s.compare(s.length() - 4, 4, ".avi") == 0))
         {
           if (random(100) > 90)
           {
@@ -201,6 +236,9 @@ void loop()
               }
 
               avi_feed_audio();
+#ifdef AVI_LOOP_COUNT
+              audio_task_hold = (AVI_LOOP_COUNT > 1); // the player task ends with the audio, keep it for the replays
+#endif
 
               if (avi_aFormat == PCM_CODEC_CODE)
               {
@@ -229,6 +267,9 @@ void loop()
               avi_start_ms = millis();
 
               Serial.println("Start play loop");
+#ifdef AVI_LOOP_COUNT
+              int avi_plays = 1;
+#endif
               while (avi_curr_frame < avi_total_frames)
               {
 #ifdef AVI_SUPPORT_AUDIO
@@ -239,8 +280,26 @@ void loop()
                 {
                   avi_draw(0, 0);
                 }
+
+#ifdef AVI_LOOP_COUNT
+                if ((avi_curr_frame >= avi_total_frames) && (avi_plays < AVI_LOOP_COUNT))
+                {
+                  ++avi_plays;
+                  Serial.printf("AVI play %d\n", avi_plays);
+                  avi_seek_frame(0); // a clip in PSRAM plays again without touching the file system
+                  avi_reset_stat();
+#ifdef AVI_SUPPORT_AUDIO
+                  avi_feed_audio(); // audbuf_read > 0 again before the hold ends
+                  audio_task_hold = (avi_plays < AVI_LOOP_COUNT);
+#endif
+                }
+#endif
               }
 
+#if defined(AVI_SUPPORT_AUDIO) && defined(AVI_LOOP_COUNT)
+              audio_task_hold = false; // a failed seek leaves the loop before the last play
+#endif // AVI_SUPPORT_AUDIO && AVI_LOOP_COUNT
+
 #if defined(AVI_SUPPORT_AUDIO) && defined(AUDIO_MUTE)
               digitalWrite(AUDIO_MUTE, LOW); // mute
 #endif
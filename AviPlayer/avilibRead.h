@@ -43,20 +43,134 @@
 
 #define AVI_MAX_TRACKS 8
 
+/* Define AVI_INDEX_CACHE before include this header to keep the decoded
+   index in a sidecar file (<filename>.idx) and reload it on next open */
+
+/* idx1 is read in blocks of this size, must be a multiple of 16 */
+#ifndef AVI_IDX1_BLOCK_SIZE
+#define AVI_IDX1_BLOCK_SIZE 4096
+#endif
+
+/* Absolute frame positions are only kept for every AVI_INDEX_CHECKPOINT-th
+   frame, the others are rebuilt from the nearest checkpoint */
+#ifndef AVI_INDEX_CHECKPOINT
+#define AVI_INDEX_CHECKPOINT 32
+#endif
+
+#define AVI_INDEX_GAP_OVERFLOW 0xFFFF
+#define AVI_INDEX_LEN_OVERFLOW 0xFFFF
+
+/* The read-ahead buffer is split in this many windows, refilled least
+   recently used first, so a stream read ahead of the other (audio usually
+   leads video) does not evict the window the other is still using.
+   Refills start on a multiple of AVI_READ_AHEAD_ALIGN. */
+#ifndef AVI_READ_AHEAD_SLOTS
+#define AVI_READ_AHEAD_SLOTS 2
+#endif
+#ifndef AVI_READ_AHEAD_ALIGN
+#define AVI_READ_AHEAD_ALIGN 512
+#endif
+
+#define AVIIF_KEYFRAME 0x00000010L
+
+/* OpenDML index types (bIndexType) */
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS 0x01
+
+/* OpenDML standard index entry size flag: not a keyframe */
+#define AVI_STD_INDEX_DELTA 0x80000000L
+
 typedef struct __attribute__((packed))
 {
-   off_t pos;
-   uint16_t len;
-   uint8_t key;
-} video_index_entry;
+   uint32_t frame;
+   off_t gap;
+} video_index_overflow;
+
+typedef struct __attribute__((packed))
+{
+   uint32_t frame;
+   uint32_t len;
+} video_index_len_overflow;
+
+/* Compact video index: frame position = position of the previous frame
+   + its length + the gap (interleaved audio and chunk headers) */
+typedef struct
+{
+   long frames;       /* number of frames filled */
+   long max_frames;   /* number of frames allocated */
+   uint16_t *len;     /* chunk length of each frame */
+   uint16_t *gap;     /* bytes from the end of the previous frame */
+   uint8_t *key;      /* keyframe bitset */
+   off_t *checkpoint; /* position of every AVI_INDEX_CHECKPOINT-th frame */
+
+   video_index_overflow *overflow; /* gaps that do not fit in gap[] */
+   long n_overflow;
+   long max_overflow;
+
+   video_index_len_overflow *len_overflow; /* lengths that do not fit in len[] */
+   long n_len_overflow;
+   long max_len_overflow;
+
+   long last_frame; /* last frame looked up, -1 if none */
+   off_t last_pos;  /* position of last_frame */
+
+   unsigned long lookups; /* position lookups done */
+   unsigned long steps;   /* frames walked by the lookups */
+} video_index_t;
+
+typedef struct
+{
+   off_t start;        /* file position of the first byte */
+   long len;           /* valid bytes */
+   unsigned long used; /* read-ahead tick of the last use */
+} avi_read_ahead_slot;
+
+/* Read-ahead cache shared by the video and audio reads, so the interleaved
+   chunks of both streams come from the same large reads */
+typedef struct
+{
+   char *buf;
+   long size;      /* bytes allocated */
+   long slot_size; /* bytes per window */
+   avi_read_ahead_slot slot[AVI_READ_AHEAD_SLOTS];
+   unsigned long tick;
+   off_t pos; /* file position of the next AVI_read_data() */
+
+   unsigned long hits;   /* reads served from the window */
+   unsigned long misses; /* reads that had to go to the file */
+   unsigned long fills;  /* window refills */
+   unsigned long direct; /* reads larger than the window, not cached */
+   unsigned long bytes;  /* bytes read from the file */
+} avi_read_ahead_t;
 
 typedef struct __attribute__((packed))
 {
    off_t pos;
-   uint16_t len;
+   uint32_t len;
    off_t tot;
 } audio_index_entry;
 
+/* OpenDML super index (indx) entry, one per ix## standard index segment */
+typedef struct __attribute__((packed))
+{
+   off_t offset;      /* position of the ix## chunk */
+   uint32_t size;     /* size of the ix## chunk */
+   uint32_t duration; /* stream ticks covered by the segment */
+   long first;        /* first frame or audio chunk of the segment */
+   off_t tot;         /* audio bytes before the segment */
+} avi_super_index_entry;
+
+/* Only the super index is kept in memory, the segment holding the current
+   position is loaded into the normal index arrays when it is reached */
+typedef struct
+{
+   long entries;
+   avi_super_index_entry *entry;
+   long loaded;         /* segment in the index arrays, -1 if none */
+   long known;          /* segments whose first and tot are known */
+   unsigned long loads; /* segments loaded so far */
+} avi_super_index_t;
+
 typedef struct __attribute__((packed)) track_s
 {
    long a_fmt;   /* Audio format, see #defines below */
@@ -77,6 +191,8 @@ typedef struct __attribute__((packed)) track_s
    off_t a_codecf_off; /* absolut offset of audio codec information */
 
    audio_index_entry *audio_index;
+   avi_super_index_t *audio_super; /* OpenDML super index, 0 for idx1 */
+   long audio_seg_chunks;          /* chunks in audio_index */
 } track_t;
 
 typedef struct __attribute__((packed))
@@ -121,6 +237,9 @@ typedef struct __attribute__((packed))
    char video_tag[4];   /* Tag of video data */
    long video_pos;      /* Number of next frame to be read
                (if index present) */
+   long audio_left;     /* bytes of the audio chunk AVI_read_data() has not
+               returned yet */
+   int audio_pad;       /* pad byte after them */
 
    unsigned long max_len; /* maximum video chunk present */
 
@@ -133,7 +252,13 @@ typedef struct __attribute__((packed))
    off_t v_codech_off; /* absolut offset of video codec (strh) info */
    off_t v_codecf_off; /* absolut offset of video codec (strf) info */
 
-   video_index_entry *video_index;
+   video_index_t *video_index;
+   avi_super_index_t *video_super; /* OpenDML super index, 0 for idx1 */
+   avi_read_ahead_t *read_ahead;   /* 0 if reads go straight to the file */
+
+   char *ram;       /* AVI_load_to_ram() image of the file from movi_start, or 0 */
+   off_t ram_start; /* file position of ram[0] */
+   long ram_len;
 
    off_t last_pos;         /* Position of last frame written */
    unsigned long last_len; /* Length of last frame written */
@@ -146,8 +271,37 @@ typedef struct __attribute__((packed))
 
    BITMAPINFOHEADER_avilib *bitmap_info_header;
    WAVEFORMATEX_avilib *wave_format_ex[AVI_MAX_TRACKS];
+
+#ifdef AVI_INDEX_CACHE
+   char *index_cache_file; /* sidecar index file name */
+   int index_cache_hit;    /* 1 if the index was loaded from the sidecar */
+#endif
 } avi_t;
 
+#ifdef AVI_INDEX_CACHE
+#define AVI_INDEX_CACHE_MAGIC 0x31584449 /* "IDX1" */
+#define AVI_INDEX_CACHE_VERSION 4
+
+typedef struct __attribute__((packed))
+{
+   uint32_t magic;
+   uint16_t version;
+   uint16_t checkpoint_interval;
+   uint16_t audio_entry_size;
+   uint64_t file_size; /* size of the AVI file the index belongs to */
+   int64_t mtime;      /* modification time of the AVI file */
+   int64_t movi_start;
+   uint32_t n_idx;
+   uint32_t video_frames;
+   uint32_t max_len;
+   uint32_t n_overflow;
+   uint32_t n_len_overflow;
+   uint32_t anum;
+   uint32_t audio_chunks[AVI_MAX_TRACKS];
+   uint64_t audio_bytes[AVI_MAX_TRACKS];
+} avi_index_cache_header;
+#endif
+
 #define AVI_MODE_WRITE 0
 #define AVI_MODE_READ 1
 
@@ -189,6 +343,223 @@ typedef struct __attribute__((packed))
                              getIndex==0, but an operation has been \
                              performed that needs an index */
 
+static void avi_video_index_free(video_index_t *vi)
+{
+   free(vi->len);
+   free(vi->gap);
+   free(vi->key);
+   free(vi->checkpoint);
+   free(vi->overflow);
+   free(vi->len_overflow);
+   free(vi);
+}
+
+/* Make room for frames entries, returns 0 if out of memory */
+
+static int avi_video_index_reserve(video_index_t *vi, long frames)
+{
+   void *p;
+
+   log_i("realloc(video_index): %d, free PSRAM: %d", frames * (sizeof(uint16_t) + sizeof(uint16_t)) + (frames + 7) / 8 + (frames / AVI_INDEX_CHECKPOINT + 1) * sizeof(off_t), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+   if ((p = realloc(vi->len, frames * sizeof(uint16_t))) == 0)
+      return 0;
+   vi->len = (uint16_t *)p;
+   if ((p = realloc(vi->gap, frames * sizeof(uint16_t))) == 0)
+      return 0;
+   vi->gap = (uint16_t *)p;
+   if ((p = realloc(vi->key, (frames + 7) / 8)) == 0)
+      return 0;
+   vi->key = (uint8_t *)p;
+   if ((p = realloc(vi->checkpoint, (frames / AVI_INDEX_CHECKPOINT + 1) * sizeof(off_t))) == 0)
+      return 0;
+   vi->checkpoint = (off_t *)p;
+   if (frames > vi->max_frames)
+      memset(vi->key + (vi->max_frames + 7) / 8, 0, (frames + 7) / 8 - (vi->max_frames + 7) / 8);
+   vi->max_frames = frames;
+   return 1;
+}
+
+static video_index_t *avi_video_index_new(long frames)
+{
+   video_index_t *vi = (video_index_t *)calloc(1, sizeof(video_index_t));
+
+   if (vi == 0)
+      return 0;
+   vi->last_frame = -1;
+   if (!avi_video_index_reserve(vi, frames))
+   {
+      avi_video_index_free(vi);
+      return 0;
+   }
+   return vi;
+}
+
+/* Chunk length of frame, 64 KB and larger chunks are rare enough for a
+   table beside len[] */
+
+static long avi_video_index_len(video_index_t *vi, long frame)
+{
+   long n0, n1, n;
+
+   if (vi->len[frame] != AVI_INDEX_LEN_OVERFLOW)
+      return vi->len[frame];
+
+   n0 = 0;
+   n1 = vi->n_len_overflow;
+   while (n0 < n1 - 1)
+   {
+      n = (n0 + n1) / 2;
+      if (vi->len_overflow[n].frame > (uint32_t)frame)
+         n1 = n;
+      else
+         n0 = n;
+   }
+   return vi->len_overflow[n0].len;
+}
+
+/* Append a frame, frames must be added in file order. Returns 0 if out
+   of memory. */
+
+static int avi_video_index_add(video_index_t *vi, off_t pos, unsigned long len, int key)
+{
+   long i = vi->frames;
+   off_t gap;
+   void *p;
+
+   if ((i >= vi->max_frames) && !avi_video_index_reserve(vi, vi->max_frames * 2))
+      return 0;
+
+   if (len < AVI_INDEX_LEN_OVERFLOW)
+   {
+      vi->len[i] = len;
+   }
+   else
+   {
+      if (vi->n_len_overflow >= vi->max_len_overflow)
+      {
+         vi->max_len_overflow = vi->max_len_overflow ? vi->max_len_overflow * 2 : 16;
+         if ((p = realloc(vi->len_overflow, vi->max_len_overflow * sizeof(video_index_len_overflow))) == 0)
+            return 0;
+         vi->len_overflow = (video_index_len_overflow *)p;
+      }
+      vi->len_overflow[vi->n_len_overflow].frame = i;
+      vi->len_overflow[vi->n_len_overflow].len = len;
+      vi->n_len_overflow++;
+      vi->len[i] = AVI_INDEX_LEN_OVERFLOW;
+   }
+   if (key)
+      vi->key[i >> 3] |= 1 << (i & 7);
+
+   if ((i % AVI_INDEX_CHECKPOINT) == 0)
+   {
+      vi->checkpoint[i / AVI_INDEX_CHECKPOINT] = pos;
+      vi->gap[i] = 0;
+   }
+   else
+   {
+      gap = pos - (vi->last_pos + avi_video_index_len(vi, i - 1));
+      if ((gap >= 0) && (gap < AVI_INDEX_GAP_OVERFLOW))
+      {
+         vi->gap[i] = gap;
+      }
+      else
+      {
+         if (vi->n_overflow >= vi->max_overflow)
+         {
+            vi->max_overflow = vi->max_overflow ? vi->max_overflow * 2 : 16;
+            if ((p = realloc(vi->overflow, vi->max_overflow * sizeof(video_index_overflow))) == 0)
+               return 0;
+            vi->overflow = (video_index_overflow *)p;
+         }
+         vi->overflow[vi->n_overflow].frame = i;
+         vi->overflow[vi->n_overflow].gap = gap;
+         vi->n_overflow++;
+         vi->gap[i] = AVI_INDEX_GAP_OVERFLOW;
+      }
+   }
+
+   vi->last_pos = pos;
+   vi->frames++;
+   return 1;
+}
+
+static off_t avi_video_index_gap(video_index_t *vi, long frame)
+{
+   long n0, n1, n;
+
+   if (vi->gap[frame] != AVI_INDEX_GAP_OVERFLOW)
+      return vi->gap[frame];
+
+   /* Binary search in the overflow gaps */
+
+   n0 = 0;
+   n1 = vi->n_overflow;
+   while (n0 < n1 - 1)
+   {
+      n = (n0 + n1) / 2;
+      if (vi->overflow[n].frame > (uint32_t)frame)
+         n1 = n;
+      else
+         n0 = n;
+   }
+   return vi->overflow[n0].gap;
+}
+
+/* Position of frame, walks forward from the last looked up frame when it is
+   in the same checkpoint interval, so sequential access is O(1) */
+
+static off_t avi_video_index_pos(video_index_t *vi, long frame)
+{
+   long i;
+   off_t pos;
+
+   if ((vi->last_frame >= 0) && (vi->last_frame <= frame) &&
+       ((vi->last_frame / AVI_INDEX_CHECKPOINT) == (frame / AVI_INDEX_CHECKPOINT)))
+   {
+      i = vi->last_frame;
+      pos = vi->last_pos;
+   }
+   else
+   {
+      i = frame - (frame % AVI_INDEX_CHECKPOINT);
+      pos = vi->checkpoint[i / AVI_INDEX_CHECKPOINT];
+   }
+
+   vi->lookups++;
+   while (i < frame)
+   {
+      pos += avi_video_index_len(vi, i++);
+      pos += avi_video_index_gap(vi, i);
+      vi->steps++;
+   }
+
+   vi->last_frame = frame;
+   vi->last_pos = pos;
+   return pos;
+}
+
+static int avi_video_index_is_key(video_index_t *vi, long frame)
+{
+   return (vi->key[frame >> 3] >> (frame & 7)) & 1;
+}
+
+/* Empty the index for reuse by the next OpenDML segment */
+
+static void avi_video_index_clear(video_index_t *vi)
+{
+   memset(vi->key, 0, (vi->max_frames + 7) / 8);
+   vi->frames = 0;
+   vi->n_overflow = 0;
+   vi->n_len_overflow = 0;
+   vi->last_frame = -1;
+}
+
+static void avi_super_index_free(avi_super_index_t *si)
+{
+   free(si->entry);
+   free(si);
+}
+
 int AVI_close(avi_t *AVI)
 {
    int ret, i;
@@ -205,7 +576,16 @@ int AVI_close(avi_t *AVI)
 
    close(AVI->fdes);
    if (AVI->video_index)
-      free(AVI->video_index);
+      avi_video_index_free(AVI->video_index);
+   if (AVI->video_super)
+      avi_super_index_free(AVI->video_super);
+   if (AVI->read_ahead)
+   {
+      free(AVI->read_ahead->buf);
+      free(AVI->read_ahead);
+   }
+   if (AVI->ram)
+      free(AVI->ram);
    // FIXME
    // if(AVI->audio_index) free(AVI->audio_index);
    if (AVI->bitmap_info_header)
@@ -214,19 +594,26 @@ int AVI_close(avi_t *AVI)
    {
       if (AVI->wave_format_ex[i])
          free(AVI->wave_format_ex[i]);
-      if (AVI->track[i].audio_chunks)
+      if (AVI->track[i].audio_index)
          free(AVI->track[i].audio_index);
+      if (AVI->track[i].audio_super)
+         avi_super_index_free(AVI->track[i].audio_super);
    }
+#ifdef AVI_INDEX_CACHE
+   if (AVI->index_cache_file)
+      free(AVI->index_cache_file);
+#endif
    free(AVI);
 
    return ret;
 }
 
+/* closes and frees AVI, avi_parse_input_file() returns -1 */
 #define ERR_EXIT(x)   \
    {                  \
       AVI_close(AVI); \
       AVI_errno = x;  \
-      return 0;       \
+      return -1;      \
    }
 
 /* The following variable indicates the kind of error */
@@ -270,6 +657,12 @@ static unsigned long str2ushort(unsigned char *str)
    return (str[0] | (str[1] << 8));
 }
 
+/* Read a FourCC as a 32 bit number with its letters folded to lower case,
+   so tags compare as integers the same way strncasecmp() did. Digits are
+   not changed by the folding. */
+
+#define AVI_FOURCC_LOWER(str) ((uint32_t)str2ulong(str) | 0x20202020)
+
 /* Calculate audio sample size from number of bits and number of channels.
    This may have to be adjusted for eg. 12 bits and stereo */
 
@@ -300,6 +693,576 @@ static size_t avi_read(int fd, char *buf, size_t len)
    return r;
 }
 
+/* Read len bytes at file position pos, through the read-ahead windows when
+   they are enabled. Reads that do not fit in a window go straight to the
+   file. */
+
+static size_t avi_read_at(avi_t *AVI, off_t pos, char *buf, size_t len)
+{
+   avi_read_ahead_t *ra = AVI->read_ahead;
+   avi_read_ahead_slot *sl;
+   size_t r = 0, n;
+   off_t end;
+   int i, missed = 0;
+
+   if (AVI->ram && (pos >= AVI->ram_start) && (pos + (off_t)len <= AVI->ram_start + AVI->ram_len))
+   {
+      memcpy(buf, AVI->ram + (pos - AVI->ram_start), len);
+      return len;
+   }
+
+   if (!ra)
+   {
+      lseek(AVI->fdes, pos, SEEK_SET);
+      return avi_read(AVI->fdes, buf, len);
+   }
+
+   ra->tick++;
+   while (r < len)
+   {
+      for (i = 0; i < AVI_READ_AHEAD_SLOTS; i++)
+      {
+         sl = &ra->slot[i];
+         if ((pos >= sl->start) && (pos < sl->start + sl->len))
+            break;
+      }
+      if (i < AVI_READ_AHEAD_SLOTS)
+      {
+         n = sl->start + sl->len - pos;
+         if (n > len - r)
+            n = len - r;
+         memcpy(buf + r, ra->buf + i * ra->slot_size + (pos - sl->start), n);
+         sl->used = ra->tick;
+         r += n;
+         pos += n;
+         continue;
+      }
+
+      missed = 1;
+      if ((off_t)(len - r) >= ra->slot_size - (pos % AVI_READ_AHEAD_ALIGN))
+      {
+         lseek(AVI->fdes, pos, SEEK_SET);
+         n = avi_read(AVI->fdes, buf + r, len - r);
+         ra->direct++;
+         ra->bytes += n;
+         r += n;
+         break;
+      }
+
+      /* refill the least recently used window, but keep the one the read
+         runs into next */
+      sl = 0;
+      for (i = 0; i < AVI_READ_AHEAD_SLOTS; i++)
+      {
+         if ((ra->slot[i].len > 0) && (ra->slot[i].start > pos) && (ra->slot[i].start < pos + ra->slot_size))
+            continue;
+         if (!sl || (ra->slot[i].used < sl->used))
+            sl = &ra->slot[i];
+      }
+      if (!sl)
+         sl = &ra->slot[0];
+      sl->start = pos - (pos % AVI_READ_AHEAD_ALIGN);
+      sl->len = 0;
+
+      /* stop where another window starts, those bytes are cached already */
+      end = sl->start + ra->slot_size;
+      for (i = 0; i < AVI_READ_AHEAD_SLOTS; i++)
+         if ((ra->slot[i].start > pos) && (ra->slot[i].start < end) && (ra->slot[i].len > 0))
+            end = ra->slot[i].start;
+
+      i = sl - ra->slot;
+      lseek(AVI->fdes, sl->start, SEEK_SET);
+      sl->len = avi_read(AVI->fdes, ra->buf + i * ra->slot_size, end - sl->start);
+      sl->used = ra->tick;
+      ra->fills++;
+      ra->bytes += sl->len;
+      if (pos >= sl->start + sl->len)
+         break; /* end of file */
+   }
+
+   if (missed)
+      ra->misses++;
+   else
+      ra->hits++;
+   return r;
+}
+
+/* Sequential read and skip for AVI_read_data() */
+
+static size_t avi_read_next(avi_t *AVI, char *buf, size_t len)
+{
+   size_t r;
+
+   if (!AVI->read_ahead)
+      return avi_read(AVI->fdes, buf, len);
+   r = avi_read_at(AVI, AVI->read_ahead->pos, buf, len);
+   AVI->read_ahead->pos += r;
+   return r;
+}
+
+static off_t avi_skip(avi_t *AVI, off_t n)
+{
+   if (!AVI->read_ahead)
+      return lseek(AVI->fdes, n, SEEK_CUR);
+   AVI->read_ahead->pos += n;
+   return AVI->read_ahead->pos;
+}
+
+/* Resize an index array to hold entries elements, returns 0 if out of memory
+   and leaves the old array untouched in that case */
+
+static void *avi_grow_index(void *index, long entries, size_t entry_size)
+{
+   log_i("realloc(index): %d, free PSRAM: %d", entries * entry_size, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+   return realloc(index, entries * entry_size);
+}
+
+/* Build a super index from the data of an indx chunk, returns 0 if it is
+   not an index of indexes or out of memory. Offsets beyond the range of
+   off_t end the index. */
+
+static avi_super_index_t *avi_super_index_new(unsigned char *indx, long size)
+{
+   avi_super_index_t *si;
+   unsigned char *e;
+   long i, n;
+
+   if (size < 24 || str2ushort(indx) != 4 || indx[3] != AVI_INDEX_OF_INDEXES)
+      return 0;
+   n = str2ulong(indx + 4);
+   if (n > (size - 24) / 16)
+      n = (size - 24) / 16;
+   if (n <= 0)
+      return 0;
+
+   si = (avi_super_index_t *)calloc(1, sizeof(avi_super_index_t));
+   if (si == 0)
+      return 0;
+   log_i("malloc(super_index): %d, free PSRAM: %d", n * sizeof(avi_super_index_entry), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+   si->entry = (avi_super_index_entry *)calloc(n, sizeof(avi_super_index_entry));
+   if (si->entry == 0)
+   {
+      free(si);
+      return 0;
+   }
+
+   for (i = 0, e = indx + 24; i < n; i++, e += 16)
+   {
+      if (str2ulong(e + 4) != 0 || (off_t)str2ulong(e) < 0)
+         break;
+      si->entry[i].offset = str2ulong(e);
+      si->entry[i].size = str2ulong(e + 8);
+      si->entry[i].duration = str2ulong(e + 12);
+   }
+   si->entries = i;
+   si->loaded = -1;
+   return si;
+}
+
+/* Seek to the entries of the OpenDML standard index (ix##) at offset,
+   returns the number of entries and sets base, or -1 if it is not usable */
+
+static long avi_std_index_open(avi_t *AVI, off_t offset, off_t *base)
+{
+   unsigned char hdr[32];
+   long n;
+
+   lseek(AVI->fdes, offset, SEEK_SET);
+   if (avi_read(AVI->fdes, (char *)hdr, 32) != 32)
+      return -1;
+   if (str2ushort(hdr + 8) != 2 || hdr[11] != AVI_INDEX_OF_CHUNKS || str2ulong(hdr + 24) != 0)
+      return -1;
+   n = str2ulong(hdr + 12);
+   if (n < 0 || n > (long)(str2ulong(hdr + 4) - 24) / 8)
+      return -1;
+   *base = str2ulong(hdr + 20);
+   return n;
+}
+
+/* Load segment seg of the video super index into AVI->video_index */
+
+static int avi_load_video_segment(avi_t *AVI, long seg)
+{
+   video_index_t *vi = AVI->video_index;
+   avi_super_index_t *si = AVI->video_super;
+   unsigned char *buf, *e;
+   long count, left, n, k;
+   off_t base;
+   uint32_t size;
+
+   si->loaded = -1;
+   count = avi_std_index_open(AVI, si->entry[seg].offset, &base);
+   if (count < 0)
+      return -1;
+   if ((count > vi->max_frames) && !avi_video_index_reserve(vi, count))
+      return -1;
+   avi_video_index_clear(vi);
+
+   buf = (unsigned char *)malloc(AVI_IDX1_BLOCK_SIZE);
+   if (buf == 0)
+      return -1;
+   for (left = count; left > 0; left -= n)
+   {
+      n = (left < AVI_IDX1_BLOCK_SIZE / 8) ? left : AVI_IDX1_BLOCK_SIZE / 8;
+      if (avi_read(AVI->fdes, (char *)buf, n * 8) != (size_t)(n * 8))
+         break;
+      for (k = 0, e = buf; k < n; k++, e += 8)
+      {
+         size = str2ulong(e + 4);
+         if (!avi_video_index_add(vi, base + str2ulong(e), size & ~AVI_STD_INDEX_DELTA, !(size & AVI_STD_INDEX_DELTA)))
+            break;
+         if ((size & ~AVI_STD_INDEX_DELTA) > AVI->max_len)
+            AVI->max_len = size & ~AVI_STD_INDEX_DELTA;
+      }
+      if (k < n)
+         break;
+   }
+   free(buf);
+   if (vi->frames != count)
+      return -1;
+
+   si->loaded = seg;
+   si->loads++;
+   return 0;
+}
+
+/* Load segment seg of the audio super index of track j into its audio_index.
+   Audio segments only learn where they start in the stream from the ones
+   before them, so they have to be reached in order the first time. */
+
+static int avi_load_audio_segment(avi_t *AVI, int j, long seg)
+{
+   avi_super_index_t *si = AVI->track[j].audio_super;
+   audio_index_entry *ai;
+   unsigned char *buf, *e;
+   long count, left, n, k;
+   off_t base, tot;
+
+   if (seg >= si->known)
+      return -1;
+   si->loaded = -1;
+   AVI->track[j].audio_seg_chunks = 0;
+   count = avi_std_index_open(AVI, si->entry[seg].offset, &base);
+   if (count < 0)
+      return -1;
+
+   /* keep one spare entry for the zero terminator */
+   ai = (audio_index_entry *)avi_grow_index(AVI->track[j].audio_index, count + 1, sizeof(audio_index_entry));
+   if (ai == 0)
+      return -1;
+   AVI->track[j].audio_index = ai;
+
+   buf = (unsigned char *)malloc(AVI_IDX1_BLOCK_SIZE);
+   if (buf == 0)
+      return -1;
+   tot = si->entry[seg].tot;
+   for (left = count, k = 0; left > 0; left -= n)
+   {
+      n = (left < AVI_IDX1_BLOCK_SIZE / 8) ? left : AVI_IDX1_BLOCK_SIZE / 8;
+      if (avi_read(AVI->fdes, (char *)buf, n * 8) != (size_t)(n * 8))
+         break;
+      for (e = buf; e < buf + n * 8; e += 8, k++)
+      {
+         ai[k].pos = base + str2ulong(e);
+         ai[k].len = str2ulong(e + 4) & ~AVI_STD_INDEX_DELTA;
+         ai[k].tot = tot;
+         tot += ai[k].len;
+      }
+   }
+   free(buf);
+   if (k != count)
+      return -1;
+   memset(&ai[count], 0, sizeof(audio_index_entry));
+
+   if ((seg + 1 == si->known) && (seg + 1 < si->entries))
+   {
+      si->entry[seg + 1].first = si->entry[seg].first + count;
+      si->entry[seg + 1].tot = tot;
+      si->known++;
+   }
+   /* chunks seen so far, the total is only known after the last segment */
+   if (si->entry[seg].first + count > AVI->track[j].audio_chunks)
+      AVI->track[j].audio_chunks = si->entry[seg].first + count;
+   AVI->track[j].audio_seg_chunks = count;
+   si->loaded = seg;
+   si->loads++;
+   return 0;
+}
+
+/* Continue the current audio track with its next OpenDML segment,
+   returns 0 if there is none */
+
+static int avi_audio_next_segment(avi_t *AVI)
+{
+   avi_super_index_t *si = AVI->track[AVI->aptr].audio_super;
+
+   if (!si || (si->loaded < 0) || (si->loaded + 1 >= si->entries))
+      return 0;
+   if (avi_load_audio_segment(AVI, AVI->aptr, si->loaded + 1) != 0)
+      return 0;
+   AVI->track[AVI->aptr].audio_posc = 0;
+   AVI->track[AVI->aptr].audio_posb = 0;
+   return 1;
+}
+
+/* Map a frame number to its entry in AVI->video_index, loading the OpenDML
+   segment holding it if needed. Returns -1 if the frame is not indexed. */
+
+static long avi_video_frame(avi_t *AVI, long frame)
+{
+   avi_super_index_t *si = AVI->video_super;
+   long n0, n1, n;
+
+   if (!si)
+      return frame;
+
+   if ((si->loaded < 0) || (frame < si->entry[si->loaded].first) ||
+       (frame >= si->entry[si->loaded].first + AVI->video_index->frames))
+   {
+      /* Binary search in the super index */
+
+      n0 = 0;
+      n1 = si->entries;
+      while (n0 < n1 - 1)
+      {
+         n = (n0 + n1) / 2;
+         if (si->entry[n].first > frame)
+            n1 = n;
+         else
+            n0 = n;
+      }
+      if ((n0 != si->loaded) && (avi_load_video_segment(AVI, n0) != 0))
+         return -1;
+      if (frame - si->entry[n0].first >= AVI->video_index->frames)
+         return -1;
+   }
+   return frame - si->entry[si->loaded].first;
+}
+
+/* Map an audio chunk number of the current track to its entry in
+   audio_index, loading OpenDML segments if needed, or -1 */
+
+static long avi_audio_chunk(avi_t *AVI, long chunk)
+{
+   avi_super_index_t *si = AVI->track[AVI->aptr].audio_super;
+   long seg;
+
+   if (!si)
+      return chunk;
+
+   seg = 0;
+   while (1)
+   {
+      while ((seg + 1 < si->known) && (si->entry[seg + 1].first <= chunk))
+         seg++;
+      if ((seg != si->loaded) && (avi_load_audio_segment(AVI, AVI->aptr, seg) != 0))
+         return -1;
+      if ((seg + 1 < si->known) && (si->entry[seg + 1].first <= chunk))
+         continue;
+      break;
+   }
+   if (chunk - si->entry[seg].first >= AVI->track[AVI->aptr].audio_seg_chunks)
+      return -1;
+   return chunk - si->entry[seg].first;
+}
+
+#ifdef AVI_INDEX_CACHE
+/* Fill the cache header fields that identify the AVI file. The file is
+   looked up by name: fstat() on the ESP-IDF FAT VFS leaves st_mtime 0,
+   and a clip re-encoded to the same size would match a stale sidecar. */
+
+static int avi_index_cache_stat(avi_t *AVI, avi_index_cache_header *h)
+{
+   struct stat st;
+   size_t n = strlen(AVI->index_cache_file) - 4; /* drop ".idx" */
+   int ret;
+
+   AVI->index_cache_file[n] = 0;
+   ret = stat(AVI->index_cache_file, &st);
+   AVI->index_cache_file[n] = '.';
+   if (ret != 0)
+      return -1;
+
+   memset(h, 0, sizeof(avi_index_cache_header));
+   h->magic = AVI_INDEX_CACHE_MAGIC;
+   h->version = AVI_INDEX_CACHE_VERSION;
+   h->checkpoint_interval = AVI_INDEX_CHECKPOINT;
+   h->audio_entry_size = sizeof(audio_index_entry);
+   h->file_size = st.st_size;
+   h->mtime = st.st_mtime;
+   h->movi_start = AVI->movi_start;
+   h->anum = AVI->anum;
+   return 0;
+}
+
+/* Load video_index and audio_index from the sidecar file, returns 0 on
+   success and -1 if the sidecar is missing or does not match the AVI file */
+
+static int avi_read_index_cache(avi_t *AVI)
+{
+   avi_index_cache_header expect, h;
+   video_index_t *vi;
+   size_t len;
+   int fd, j;
+
+   if (avi_index_cache_stat(AVI, &expect) != 0)
+      return -1;
+
+   fd = open(AVI->index_cache_file, O_RDONLY);
+   if (fd < 0)
+      return -1;
+
+   if ((avi_read(fd, (char *)&h, sizeof(h)) != sizeof(h)) ||
+       (h.magic != expect.magic) ||
+       (h.version != expect.version) ||
+       (h.checkpoint_interval != expect.checkpoint_interval) ||
+       (h.audio_entry_size != expect.audio_entry_size) ||
+       (h.file_size != expect.file_size) ||
+       (h.mtime != expect.mtime) ||
+       (h.movi_start != expect.movi_start) ||
+       (h.anum != expect.anum) ||
+       (h.video_frames == 0))
+   {
+      close(fd);
+      return -1;
+   }
+
+   AVI->video_index = vi = avi_video_index_new(h.video_frames);
+   if (vi == 0)
+      goto fail;
+   vi->frames = h.video_frames;
+   if ((avi_read(fd, (char *)vi->len, vi->frames * sizeof(uint16_t)) != vi->frames * sizeof(uint16_t)) ||
+       (avi_read(fd, (char *)vi->gap, vi->frames * sizeof(uint16_t)) != vi->frames * sizeof(uint16_t)) ||
+       (avi_read(fd, (char *)vi->key, (vi->frames + 7) / 8) != (vi->frames + 7) / 8) ||
+       (avi_read(fd, (char *)vi->checkpoint, ((vi->frames - 1) / AVI_INDEX_CHECKPOINT + 1) * sizeof(off_t)) != ((vi->frames - 1) / AVI_INDEX_CHECKPOINT + 1) * sizeof(off_t)))
+      goto fail;
+   if (h.n_overflow)
+   {
+      vi->n_overflow = vi->max_overflow = h.n_overflow;
+      len = vi->n_overflow * sizeof(video_index_overflow);
+      vi->overflow = (video_index_overflow *)malloc(len);
+      if ((vi->overflow == 0) || (avi_read(fd, (char *)vi->overflow, len) != len))
+         goto fail;
+   }
+   if (h.n_len_overflow)
+   {
+      vi->n_len_overflow = vi->max_len_overflow = h.n_len_overflow;
+      len = vi->n_len_overflow * sizeof(video_index_len_overflow);
+      vi->len_overflow = (video_index_len_overflow *)malloc(len);
+      if ((vi->len_overflow == 0) || (avi_read(fd, (char *)vi->len_overflow, len) != len))
+         goto fail;
+   }
+
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      if (h.audio_chunks[j] == 0)
+         continue;
+
+      /* the zero terminator entry is stored as well */
+      len = (h.audio_chunks[j] + 1) * sizeof(audio_index_entry);
+      log_i("malloc(audio_index_entry): %d, free PSRAM: %d", len, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+      AVI->track[j].audio_index = (audio_index_entry *)malloc(len);
+      if ((AVI->track[j].audio_index == 0) || (avi_read(fd, (char *)AVI->track[j].audio_index, len) != len))
+         goto fail;
+   }
+   close(fd);
+
+   AVI->n_idx = AVI->max_idx = h.n_idx;
+   AVI->video_frames = h.video_frames;
+   AVI->max_len = h.max_len;
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      AVI->track[j].audio_chunks = AVI->track[j].audio_seg_chunks = h.audio_chunks[j];
+      AVI->track[j].audio_bytes = h.audio_bytes[j];
+   }
+   AVI->index_cache_hit = 1;
+
+   return 0;
+
+fail:
+   close(fd);
+   if (AVI->video_index)
+      avi_video_index_free(AVI->video_index);
+   AVI->video_index = 0;
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      if (AVI->track[j].audio_index)
+         free(AVI->track[j].audio_index);
+      AVI->track[j].audio_index = 0;
+   }
+   return -1;
+}
+
+/* Write video_index and audio_index to the sidecar file. The header is
+   written last, so an interrupted write leaves an invalid sidecar behind. */
+
+static void avi_write_index_cache(avi_t *AVI)
+{
+   avi_index_cache_header h;
+   video_index_t *vi = AVI->video_index;
+   size_t len;
+   int fd, j;
+
+   if (avi_index_cache_stat(AVI, &h) != 0)
+      return;
+
+   h.n_idx = AVI->n_idx;
+   h.video_frames = AVI->video_frames;
+   h.max_len = AVI->max_len;
+   h.n_overflow = vi->n_overflow;
+   h.n_len_overflow = vi->n_len_overflow;
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      h.audio_chunks[j] = AVI->track[j].audio_chunks;
+      h.audio_bytes[j] = AVI->track[j].audio_bytes;
+   }
+
+   fd = open(AVI->index_cache_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      return;
+
+   h.magic = 0;
+   if (write(fd, &h, sizeof(h)) != sizeof(h))
+      goto done;
+
+   len = vi->frames * sizeof(uint16_t);
+   if (write(fd, vi->len, len) != (ssize_t)len)
+      goto done;
+   len = vi->frames * sizeof(uint16_t);
+   if (write(fd, vi->gap, len) != (ssize_t)len)
+      goto done;
+   len = (vi->frames + 7) / 8;
+   if (write(fd, vi->key, len) != (ssize_t)len)
+      goto done;
+   len = ((vi->frames - 1) / AVI_INDEX_CHECKPOINT + 1) * sizeof(off_t);
+   if (write(fd, vi->checkpoint, len) != (ssize_t)len)
+      goto done;
+   len = vi->n_overflow * sizeof(video_index_overflow);
+   if (len && (write(fd, vi->overflow, len) != (ssize_t)len))
+      goto done;
+   len = vi->n_len_overflow * sizeof(video_index_len_overflow);
+   if (len && (write(fd, vi->len_overflow, len) != (ssize_t)len))
+      goto done;
+
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      if (AVI->track[j].audio_chunks == 0)
+         continue;
+
+      len = (AVI->track[j].audio_chunks + 1) * sizeof(audio_index_entry);
+      if (write(fd, AVI->track[j].audio_index, len) != (ssize_t)len)
+         goto done;
+   }
+
+   h.magic = AVI_INDEX_CACHE_MAGIC;
+   lseek(fd, 0, SEEK_SET);
+   write(fd, &h, sizeof(h));
+
+done:
+   close(fd);
+}
+#endif // AVI_INDEX_CACHE
+
 int avi_parse_input_file(avi_t *AVI, int getIndex)
 {
    long i, rate, scale, idx_type;
@@ -310,6 +1273,8 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
    long tot[AVI_MAX_TRACKS];
    int j;
    int lasttag = 0;
+   int strl_type = 0; /* stream of the current strl: 1 vids, 2 auds */
+   unsigned long v_suggested = 0;
    int vids_strh_seen = 0;
    int vids_strf_seen = 0;
    int auds_strh_seen = 0;
@@ -418,10 +1383,12 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
             if (scale != 0)
                AVI->fps = (double)rate / (double)scale;
             AVI->video_frames = str2ulong(hdrl_data + i + 32);
+            v_suggested = str2ulong(hdrl_data + i + 36);
             AVI->video_strn = num_stream;
             AVI->max_len = 0;
             vids_strh_seen = 1;
             lasttag = 1; /* vids */
+            strl_type = 1;
          }
          else if (strncasecmp((char *)hdrl_data + i, "auds", 4) == 0 && !auds_strh_seen)
          {
@@ -433,19 +1400,24 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
             if (AVI->anum > AVI_MAX_TRACKS)
             {
                fprintf(stderr, "error - only %d audio tracks supported\n", AVI_MAX_TRACKS);
-               return (-1);
+               free(hdrl_data);
+               ERR_EXIT(AVI_ERR_NO_AVI)
             }
 
             AVI->track[AVI->aptr].audio_bytes = str2ulong(hdrl_data + i + 32) * avi_sampsize(AVI, 0);
             AVI->track[AVI->aptr].audio_strn = num_stream;
             //	   auds_strh_seen = 1;
             lasttag = 2; /* auds */
+            strl_type = 2;
 
             // ThOe
             AVI->track[AVI->aptr].a_codech_off = header_offset + i;
          }
          else
+         {
             lasttag = 0;
+            strl_type = 0;
+         }
          num_stream++;
       }
       else if (strncasecmp((char *)hdrl_data + i, "strf", 4) == 0)
@@ -519,6 +1491,23 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
          }
          lasttag = 0;
       }
+      else if (strncasecmp((char *)hdrl_data + i, "dmlh", 4) == 0)
+      {
+         /* OpenDML total frames, strh only counts the first RIFF */
+         i += 8;
+         if ((long)str2ulong(hdrl_data + i) > AVI->video_frames)
+            AVI->video_frames = str2ulong(hdrl_data + i);
+         lasttag = 0;
+      }
+      else if (strncasecmp((char *)hdrl_data + i, "indx", 4) == 0)
+      {
+         i += 8;
+         if ((strl_type == 1) && !AVI->video_super)
+            AVI->video_super = avi_super_index_new(hdrl_data + i, n);
+         else if ((strl_type == 2) && !AVI->track[AVI->aptr].audio_super)
+            AVI->track[AVI->aptr].audio_super = avi_super_index_new(hdrl_data + i, n);
+         lasttag = 0;
+      }
       else
       {
          i += 8;
@@ -555,160 +1544,224 @@ int avi_parse_input_file(avi_t *AVI, int getIndex)
    /* get index if wanted */
 
    if (!getIndex)
+   {
+      /* no index to measure the frames, trust the header */
+      AVI->max_len = v_suggested;
       return (0);
+   }
 
-   /* if the file has an idx1, check if this is relative
-      to the start of the file or to the start of the movi list */
-
-   idx_type = 0;
-
-   off_t pos, len;
-   unsigned char cur_idx[16];
-
-   /* Search the first videoframe in the idx1 and look where
-      it is in the file */
+   /* OpenDML: keep only the super index and load the first segment of each
+      stream, the rest is paged in when playback or seeking reaches it */
 
-   lseek(AVI->fdes, AVI->idx1_start, SEEK_SET);
-   for (i = 0; i < AVI->n_idx; i++)
+   if (AVI->video_super)
    {
-      avi_read(AVI->fdes, (char *)cur_idx, 16);
-      if (strncasecmp((char *)cur_idx, (char *)AVI->video_tag, 3) == 0)
-         break;
-   }
-   if (i >= AVI->n_idx)
-      ERR_EXIT(AVI_ERR_NO_VIDS)
+      AVI->video_frames = 0;
+      for (i = 0; i < AVI->video_super->entries; i++)
+      {
+         AVI->video_super->entry[i].first = AVI->video_frames;
+         AVI->video_frames += AVI->video_super->entry[i].duration;
+      }
+      AVI->video_super->known = AVI->video_super->entries;
+      AVI->max_len = v_suggested;
 
-   pos = str2ulong(cur_idx + 8);
-   len = str2ulong(cur_idx + 12);
+      AVI->video_index = avi_video_index_new(AVI->video_super->entry[0].duration ? AVI->video_super->entry[0].duration : 1);
+      if (AVI->video_index == 0)
+         ERR_EXIT(AVI_ERR_NO_MEM);
+      if (avi_load_video_segment(AVI, 0) != 0)
+         ERR_EXIT(AVI_ERR_READ);
 
-   lseek(AVI->fdes, pos, SEEK_SET);
-   if (avi_read(AVI->fdes, data, 8) != 8)
-      ERR_EXIT(AVI_ERR_READ)
-   if (strncasecmp(data, (char *)cur_idx, 4) == 0 && str2ulong((unsigned char *)data + 4) == len)
-   {
-      idx_type = 1; /* Index from start of file */
-   }
-   else
-   {
-      lseek(AVI->fdes, pos + AVI->movi_start - 4, SEEK_SET);
-      if (avi_read(AVI->fdes, data, 8) != 8)
-         ERR_EXIT(AVI_ERR_READ)
-      if (strncasecmp(data, (char *)cur_idx, 4) == 0 && str2ulong((unsigned char *)data + 4) == len)
+      for (j = 0; j < AVI->anum; ++j)
       {
-         idx_type = 2; /* Index from start of movi list */
+         if (!AVI->track[j].audio_super)
+            continue;
+         AVI->track[j].audio_super->known = 1;
+         if (avi_load_audio_segment(AVI, j, 0) != 0)
+            ERR_EXIT(AVI_ERR_READ);
       }
+
+      lseek(AVI->fdes, AVI->movi_start, SEEK_SET);
+      AVI->video_pos = 0;
+      return (0);
    }
-   /* idx_type remains 0 if neither of the two tests above succeeds */
 
-   if (idx_type == 0)
+#ifdef AVI_INDEX_CACHE
+   if (AVI->index_cache_file && (avi_read_index_cache(AVI) == 0))
    {
-      /* we must search through the file to get the index */
-
       lseek(AVI->fdes, AVI->movi_start, SEEK_SET);
+      AVI->video_pos = 0;
+      return (0);
+   }
+#endif
 
-      AVI->n_idx = 0;
+   /* if the file has an idx1, check if this is relative
+      to the start of the file or to the start of the movi list */
 
-      while (1)
-      {
-         if (avi_read(AVI->fdes, data, 8) != 8)
-            break;
-         n = str2ulong((unsigned char *)data + 4);
+   idx_type = 0;
 
-         /* The movi list may contain sub-lists, ignore them */
+   /* Walk the idx1 chunk once, in AVI_IDX1_BLOCK_SIZE reads aligned to the
+      block size, counting and filling the video and audio index arrays
+      while growing them as needed. Offsets are stored as found in idx1 and
+      relocated after idx_type is known. */
 
-         if (strncasecmp(data, "LIST", 4) == 0)
-         {
-            lseek(AVI->fdes, 4, SEEK_CUR);
-            continue;
-         }
+   uint32_t vtag, atag[AVI_MAX_TRACKS], tag;
+   long nai_max[AVI_MAX_TRACKS];
+   uint32_t first_vtag = 0;
+   off_t first_vpos = -1, first_vlen = 0, file_pos, idx_end;
+   size_t carry, want, got, avail;
+   unsigned char *idx_buf, *cur_idx;
+   void *grown;
 
-         /* Skip check if we got a tag ##db, ##dc or ##wb */
+   vtag = AVI_FOURCC_LOWER((unsigned char *)AVI->video_tag) & 0x00ffffff;
+   for (j = 0; j < AVI->anum; ++j)
+      atag[j] = AVI_FOURCC_LOWER((unsigned char *)AVI->track[j].audio_tag);
 
-         lseek(AVI->fdes, PAD_EVEN(n), SEEK_CUR);
-      }
-      idx_type = 1;
+   AVI->video_index = avi_video_index_new((AVI->video_frames > 0) ? AVI->video_frames : AVI->n_idx / (AVI->anum + 1) + 1);
+   if (AVI->video_index == 0)
+      ERR_EXIT(AVI_ERR_NO_MEM);
+
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      nai_max[j] = AVI->n_idx / (AVI->anum + 1) + 1;
+      log_i("malloc(audio_index_entry): %d, free PSRAM: %d", nai_max[j] * sizeof(audio_index_entry), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+      AVI->track[j].audio_index = (audio_index_entry *)malloc(nai_max[j] * sizeof(audio_index_entry));
+      if (AVI->track[j].audio_index == 0)
+         ERR_EXIT(AVI_ERR_NO_MEM);
    }
 
-   /* Now generate the video index and audio index arrays */
+   idx_buf = (unsigned char *)malloc(AVI_IDX1_BLOCK_SIZE + 16);
+   if (idx_buf == 0)
+      ERR_EXIT(AVI_ERR_NO_MEM);
 
    nvi = 0;
    for (j = 0; j < AVI->anum; ++j)
-      nai[j] = 0;
+      nai[j] = tot[j] = 0;
 
-   lseek(AVI->fdes, AVI->idx1_start, SEEK_SET);
-   for (i = 0; i < AVI->n_idx; i++)
+   file_pos = AVI->idx1_start;
+   idx_end = AVI->idx1_start + (off_t)AVI->n_idx * 16;
+   carry = 0;
+   lseek(AVI->fdes, file_pos, SEEK_SET);
+   while (file_pos < idx_end)
    {
-      avi_read(AVI->fdes, (char *)cur_idx, 16);
-      if (strncasecmp((char *)cur_idx, AVI->video_tag, 3) == 0)
-         nvi++;
+      want = AVI_IDX1_BLOCK_SIZE - (file_pos % AVI_IDX1_BLOCK_SIZE);
+      if ((off_t)want > idx_end - file_pos)
+         want = idx_end - file_pos;
+      got = avi_read(AVI->fdes, (char *)idx_buf + carry, want);
+      if (got == 0)
+         break;
+      file_pos += got;
 
-      for (j = 0; j < AVI->anum; ++j)
-         if (strncasecmp((char *)cur_idx, AVI->track[j].audio_tag, 4) == 0)
-            nai[j]++;
+      cur_idx = idx_buf;
+      for (avail = carry + got; avail >= 16; avail -= 16, cur_idx += 16)
+      {
+         tag = AVI_FOURCC_LOWER(cur_idx);
+
+         // video
+         if ((tag & 0x00ffffff) == vtag)
+         {
+            if (!avi_video_index_add(AVI->video_index, str2ulong(cur_idx + 8), str2ulong(cur_idx + 12), str2ulong(cur_idx + 4) & AVIIF_KEYFRAME))
+            {
+               free(idx_buf);
+               ERR_EXIT(AVI_ERR_NO_MEM);
+            }
+            if (first_vpos < 0)
+            {
+               first_vtag = tag;
+               first_vpos = str2ulong(cur_idx + 8);
+               first_vlen = str2ulong(cur_idx + 12);
+            }
+            if (str2ulong(cur_idx + 12) > AVI->max_len)
+               AVI->max_len = str2ulong(cur_idx + 12);
+            nvi++;
+            continue;
+         }
+
+         // audio
+         for (j = 0; j < AVI->anum; ++j)
+         {
+            if (tag == atag[j])
+            {
+               /* keep one spare entry for the zero terminator */
+               if (nai[j] + 1 >= nai_max[j])
+               {
+                  nai_max[j] <<= 1;
+                  grown = avi_grow_index(AVI->track[j].audio_index, nai_max[j], sizeof(audio_index_entry));
+                  if (grown == 0)
+                  {
+                     free(idx_buf);
+                     ERR_EXIT(AVI_ERR_NO_MEM);
+                  }
+                  AVI->track[j].audio_index = (audio_index_entry *)grown;
+               }
+               AVI->track[j].audio_index[nai[j]].pos = str2ulong(cur_idx + 8);
+               AVI->track[j].audio_index[nai[j]].len = str2ulong(cur_idx + 12);
+               AVI->track[j].audio_index[nai[j]].tot = tot[j];
+               tot[j] += AVI->track[j].audio_index[nai[j]].len;
+               nai[j]++;
+               break;
+            }
+         }
+      }
+
+      memmove(idx_buf, cur_idx, avail);
+      carry = avail;
    }
 
-   AVI->video_frames = nvi;
-   for (j = 0; j < AVI->anum; ++j)
-      AVI->track[j].audio_chunks = nai[j];
+   free(idx_buf);
 
-   //   fprintf(stderr, "chunks = %ld %d %s\n", AVI->track[0].audio_chunks, AVI->anum, AVI->track[0].audio_tag);
+   /* Look where the first videoframe is in the file */
 
-   if (AVI->video_frames == 0)
-      ERR_EXIT(AVI_ERR_NO_VIDS);
-   log_i("malloc(video_index_entry): %d, free PSRAM: %d", nvi * sizeof(video_index_entry), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
-   AVI->video_index = (video_index_entry *)malloc(nvi * sizeof(video_index_entry));
-   if (AVI->video_index == 0)
-      ERR_EXIT(AVI_ERR_NO_MEM);
+   if (first_vpos < 0)
+      ERR_EXIT(AVI_ERR_NO_VIDS)
 
-   for (j = 0; j < AVI->anum; ++j)
+   lseek(AVI->fdes, first_vpos, SEEK_SET);
+   if (avi_read(AVI->fdes, data, 8) != 8)
+      ERR_EXIT(AVI_ERR_READ)
+   if (AVI_FOURCC_LOWER((unsigned char *)data) == first_vtag && str2ulong((unsigned char *)data + 4) == first_vlen)
+   {
+      idx_type = 1; /* Index from start of file */
+   }
+   else
    {
-      if (AVI->track[j].audio_chunks)
+      lseek(AVI->fdes, first_vpos + AVI->movi_start - 4, SEEK_SET);
+      if (avi_read(AVI->fdes, data, 8) != 8)
+         ERR_EXIT(AVI_ERR_READ)
+      if (AVI_FOURCC_LOWER((unsigned char *)data) == first_vtag && str2ulong((unsigned char *)data + 4) == first_vlen)
       {
-         log_i("malloc(audio_index_entry): %d, free PSRAM: %d", (nai[j] + 1) * sizeof(audio_index_entry), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
-         AVI->track[j].audio_index = (audio_index_entry *)malloc((nai[j] + 1) * sizeof(audio_index_entry));
-         memset(AVI->track[j].audio_index, 0, (nai[j] + 1) * (sizeof(audio_index_entry)));
-         if (AVI->track[j].audio_index == 0)
-            ERR_EXIT(AVI_ERR_NO_MEM);
+         idx_type = 2; /* Index from start of movi list */
       }
    }
 
-   nvi = 0;
-   for (j = 0; j < AVI->anum; ++j)
-      nai[j] = tot[j] = 0;
+   /* idx_type remains 0 if neither of the two tests above succeeds,
+      there is no usable index in that case */
 
-   ioff = idx_type == 1 ? 8 : AVI->movi_start + 4;
+   if (idx_type == 0)
+      ERR_EXIT(AVI_ERR_NO_VIDS)
 
-   lseek(AVI->fdes, AVI->idx1_start, SEEK_SET);
-   for (i = 0; i < AVI->n_idx; i++)
-   {
-      avi_read(AVI->fdes, (char *)cur_idx, 16);
+   ioff = idx_type == 1 ? 8 : AVI->movi_start + 4;
 
-      // video
-      if (strncasecmp((char *)cur_idx, AVI->video_tag, 3) == 0)
-      {
-         AVI->video_index[nvi].key = (uint8_t)str2ulong(cur_idx + 4);
-         AVI->video_index[nvi].pos = str2ulong(cur_idx + 8) + ioff;
-         AVI->video_index[nvi].len = str2ulong(cur_idx + 12);
-         nvi++;
-      }
+   AVI->video_frames = nvi;
+   for (i = 0; i <= (nvi - 1) / AVI_INDEX_CHECKPOINT; i++)
+      AVI->video_index->checkpoint[i] += ioff;
+   AVI->video_index->last_frame = -1;
 
-      // audio
-      for (j = 0; j < AVI->anum; ++j)
+   for (j = 0; j < AVI->anum; ++j)
+   {
+      AVI->track[j].audio_chunks = AVI->track[j].audio_seg_chunks = nai[j];
+      AVI->track[j].audio_bytes = tot[j];
+      for (i = 0; i < nai[j]; i++)
+         AVI->track[j].audio_index[i].pos += ioff;
+      memset(&AVI->track[j].audio_index[nai[j]], 0, sizeof(audio_index_entry));
+      if (nai[j] == 0)
       {
-
-         if (strncasecmp((char *)cur_idx, AVI->track[j].audio_tag, 4) == 0)
-         {
-            AVI->track[j].audio_index[nai[j]].pos = str2ulong(cur_idx + 8) + ioff;
-            AVI->track[j].audio_index[nai[j]].len = str2ulong(cur_idx + 12);
-            AVI->track[j].audio_index[nai[j]].tot = tot[j];
-            tot[j] += AVI->track[j].audio_index[nai[j]].len;
-            nai[j]++;
-         }
+         free(AVI->track[j].audio_index);
+         AVI->track[j].audio_index = 0;
       }
    }
 
-   for (j = 0; j < AVI->anum; ++j)
-      AVI->track[j].audio_bytes = tot[j];
+#ifdef AVI_INDEX_CACHE
+   if (AVI->index_cache_file)
+      avi_write_index_cache(AVI);
+#endif
 
    /* Reposition the file */
 
@@ -744,7 +1797,19 @@ avi_t *AVI_open_input_file(const char *filename, int getIndex)
       return 0;
    }
 
-   avi_parse_input_file(AVI, getIndex);
+#ifdef AVI_INDEX_CACHE
+   AVI->index_cache_file = (char *)malloc(strlen(filename) + 5);
+   if (AVI->index_cache_file)
+   {
+      strcpy(AVI->index_cache_file, filename);
+      strcat(AVI->index_cache_file, ".idx");
+   }
+#endif
+
+   if (avi_parse_input_file(AVI, getIndex) < 0)
+   {
+      return 0; /* AVI is freed already, AVI_errno tells why */
+   }
 
    AVI->aptr = 0; // reset
 
@@ -777,6 +1842,122 @@ long AVI_max_video_chunk(avi_t *AVI)
    return AVI->max_len;
 }
 
+/* Memory used by the video index in bytes */
+
+long AVI_video_index_bytes(avi_t *AVI)
+{
+   video_index_t *vi = AVI->video_index;
+   long bytes;
+
+   if (!vi)
+      return 0;
+   bytes = sizeof(video_index_t) + vi->max_frames * (sizeof(uint16_t) + sizeof(uint16_t)) + (vi->max_frames + 7) / 8 + (vi->max_frames / AVI_INDEX_CHECKPOINT + 1) * sizeof(off_t) + vi->max_overflow * sizeof(video_index_overflow) + vi->max_len_overflow * sizeof(video_index_len_overflow);
+   if (AVI->video_super)
+      bytes += sizeof(avi_super_index_t) + AVI->video_super->entries * sizeof(avi_super_index_entry);
+   return bytes;
+}
+
+/* Number of OpenDML index segments loaded so far, 0 for idx1 files */
+
+long AVI_index_segment_loads(avi_t *AVI)
+{
+   long loads = 0;
+   int j;
+
+   if (AVI->video_super)
+      loads += AVI->video_super->loads;
+   for (j = 0; j < AVI->anum; ++j)
+      if (AVI->track[j].audio_super)
+         loads += AVI->track[j].audio_super->loads;
+   return loads;
+}
+
+/* Serve the frame and audio reads from a read-ahead cache of size bytes,
+   preferably in PSRAM. 0 turns it off. Returns 0 on success. */
+
+int AVI_set_read_ahead(avi_t *AVI, long size)
+{
+   avi_read_ahead_t *ra = AVI->read_ahead;
+
+   if (ra)
+   {
+      lseek(AVI->fdes, ra->pos, SEEK_SET);
+      free(ra->buf);
+      free(ra);
+      AVI->read_ahead = 0;
+   }
+   if (size <= 0)
+      return 0;
+   if (size < AVI_READ_AHEAD_SLOTS * AVI_READ_AHEAD_ALIGN)
+      size = AVI_READ_AHEAD_SLOTS * AVI_READ_AHEAD_ALIGN;
+
+   ra = (avi_read_ahead_t *)calloc(1, sizeof(avi_read_ahead_t));
+   if (ra == 0)
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+   log_i("malloc(read_ahead): %d, free PSRAM: %d", size, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+   ra->buf = (char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (ra->buf == 0)
+      ra->buf = (char *)malloc(size);
+   if (ra->buf == 0)
+   {
+      free(ra);
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+   ra->size = size;
+   ra->slot_size = size / AVI_READ_AHEAD_SLOTS;
+   ra->slot_size -= ra->slot_size % AVI_READ_AHEAD_ALIGN;
+   ra->pos = lseek(AVI->fdes, 0, SEEK_CUR);
+   AVI->read_ahead = ra;
+   return 0;
+}
+
+/* AVI_load_to_ram: copy the file from the start of the movi list to its
+   end into PSRAM if it is no larger than max_bytes. Frame and audio reads
+   are then served from memory, and AVI_read_frame_ptr() hands out
+   pointers into it. Returns 0 if loaded, -1 if too large or on error. */
+
+int AVI_load_to_ram(avi_t *AVI, long max_bytes)
+{
+   off_t end;
+   long len;
+
+   if (AVI->mode == AVI_MODE_WRITE)
+   {
+      AVI_errno = AVI_ERR_NOT_PERM;
+      return -1;
+   }
+   if (AVI->ram)
+      return 0;
+
+   end = lseek(AVI->fdes, 0, SEEK_END);
+   len = end - AVI->movi_start;
+   if ((end < 0) || (len <= 0) || (len > max_bytes))
+      return -1;
+
+   log_i("malloc(ram): %d, free PSRAM: %d", len, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+   AVI->ram = (char *)heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (AVI->ram == 0)
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+   lseek(AVI->fdes, AVI->movi_start, SEEK_SET);
+   if (avi_read(AVI->fdes, AVI->ram, len) != (size_t)len)
+   {
+      free(AVI->ram);
+      AVI->ram = 0;
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+   AVI->ram_start = AVI->movi_start;
+   AVI->ram_len = len;
+   return 0;
+}
+
 int AVI_audio_tracks(avi_t *AVI)
 {
    return (AVI->anum);
@@ -852,7 +2033,9 @@ long AVI_frame_size(avi_t *AVI, long frame)
 
    if (frame < 0 || frame >= AVI->video_frames)
       return 0;
-   return (AVI->video_index[frame].len);
+   if ((frame = avi_video_frame(AVI, frame)) < 0)
+      return 0;
+   return avi_video_index_len(AVI->video_index, frame);
 }
 
 long AVI_audio_size(avi_t *AVI, long frame)
@@ -868,7 +2051,10 @@ long AVI_audio_size(avi_t *AVI, long frame)
       return -1;
    }
 
-   if (frame < 0 || frame >= AVI->track[AVI->aptr].audio_chunks)
+   /* audio_chunks only counts the OpenDML segments loaded so far */
+   if (frame < 0 || (!AVI->track[AVI->aptr].audio_super && frame >= AVI->track[AVI->aptr].audio_chunks))
+      return 0;
+   if ((frame = avi_audio_chunk(AVI, frame)) < 0)
       return 0;
    return (AVI->track[AVI->aptr].audio_index[frame].len);
 }
@@ -888,7 +2074,101 @@ long AVI_get_video_position(avi_t *AVI, long frame)
 
    if (frame < 0 || frame >= AVI->video_frames)
       return 0;
-   return (AVI->video_index[frame].pos);
+   if ((frame = avi_video_frame(AVI, frame)) < 0)
+      return 0;
+   return avi_video_index_pos(AVI->video_index, frame);
+}
+
+/* AVI_prev_key_frame: the last keyframe at or before frame, for seeking
+   into streams with delta frames. The keyframe bitset is scanned
+   backwards a byte at a time, stepping into the previous OpenDML segment
+   if needed. Returns 0 if no earlier frame is flagged, -1 on error. */
+
+long AVI_prev_key_frame(avi_t *AVI, long frame)
+{
+   long first, n;
+
+   if (AVI->mode == AVI_MODE_WRITE)
+   {
+      AVI_errno = AVI_ERR_NOT_PERM;
+      return -1;
+   }
+   if (!AVI->video_index)
+   {
+      AVI_errno = AVI_ERR_NO_IDX;
+      return -1;
+   }
+
+   if (frame < 0 || frame >= AVI->video_frames)
+      return -1;
+
+   while (1)
+   {
+      if ((n = avi_video_frame(AVI, frame)) < 0)
+      {
+         AVI_errno = AVI_ERR_READ;
+         return -1;
+      }
+      first = frame - n;
+      while (n >= 0)
+      {
+         if (((n & 7) == 7) && (AVI->video_index->key[n >> 3] == 0))
+            n -= 8;
+         else if (avi_video_index_is_key(AVI->video_index, n))
+            return first + n;
+         else
+            n--;
+      }
+      if (first == 0)
+         return 0;
+      frame = first - 1;
+   }
+}
+
+/* AVI_next_key_frame: the first keyframe at or after frame, for dropping
+   delta frames up to it. The keyframe bitset is scanned forwards a byte
+   at a time, stepping into the next OpenDML segment if needed. Returns -1
+   if no later frame is flagged or on error. */
+
+long AVI_next_key_frame(avi_t *AVI, long frame)
+{
+   long first, n, frames;
+
+   if (AVI->mode == AVI_MODE_WRITE)
+   {
+      AVI_errno = AVI_ERR_NOT_PERM;
+      return -1;
+   }
+   if (!AVI->video_index)
+   {
+      AVI_errno = AVI_ERR_NO_IDX;
+      return -1;
+   }
+
+   if (frame < 0)
+      frame = 0;
+
+   while (frame < AVI->video_frames)
+   {
+      if ((n = avi_video_frame(AVI, frame)) < 0)
+      {
+         AVI_errno = AVI_ERR_READ;
+         return -1;
+      }
+      first = frame - n;
+      frames = AVI->video_index->frames;
+      while (n < frames)
+      {
+         if (((n & 7) == 0) && (AVI->video_index->key[n >> 3] == 0))
+            n += 8;
+         else if (avi_video_index_is_key(AVI->video_index, n))
+            return first + n;
+         else
+            n++;
+      }
+      frame = first + frames;
+   }
+   return -1;
 }
 
 int AVI_seek_start(avi_t *AVI)
@@ -900,6 +2180,8 @@ int AVI_seek_start(avi_t *AVI)
    }
 
    lseek(AVI->fdes, AVI->movi_start, SEEK_SET);
+   if (AVI->read_ahead)
+      AVI->read_ahead->pos = AVI->movi_start;
    AVI->video_pos = 0;
    return 0;
 }
@@ -937,7 +2219,7 @@ int AVI_set_audio_bitrate(avi_t *AVI, long bitrate)
 
 long AVI_read_frame(avi_t *AVI, char *vidbuf, int *keyframe)
 {
-   long n;
+   long n, frame;
 
    if (AVI->mode == AVI_MODE_WRITE)
    {
@@ -952,26 +2234,113 @@ long AVI_read_frame(avi_t *AVI, char *vidbuf, int *keyframe)
 
    if (AVI->video_pos < 0 || AVI->video_pos >= AVI->video_frames)
       return -1;
-   n = AVI->video_index[AVI->video_pos].len;
+   if ((frame = avi_video_frame(AVI, AVI->video_pos)) < 0)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+   n = avi_video_index_len(AVI->video_index, frame);
+
+   *keyframe = avi_video_index_is_key(AVI->video_index, frame);
+
+   if (avi_read_at(AVI, avi_video_index_pos(AVI->video_index, frame), vidbuf, n) != (size_t)n)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+
+   AVI->video_pos++;
+
+   return n;
+}
 
-   *keyframe = (AVI->video_index[AVI->video_pos].key == 0x10) ? 1 : 0;
+/* AVI_read_frame_ptr: like AVI_read_frame, but points *vidbuf into the
+   AVI_load_to_ram() image instead of copying the frame */
+
+long AVI_read_frame_ptr(avi_t *AVI, char **vidbuf, int *keyframe)
+{
+   long n, frame;
+   off_t pos;
 
-   lseek(AVI->fdes, AVI->video_index[AVI->video_pos].pos, SEEK_SET);
+   if (AVI->mode == AVI_MODE_WRITE)
+   {
+      AVI_errno = AVI_ERR_NOT_PERM;
+      return -1;
+   }
+   if (!AVI->video_index)
+   {
+      AVI_errno = AVI_ERR_NO_IDX;
+      return -1;
+   }
 
-   if (avi_read(AVI->fdes, vidbuf, n) != n)
+   if (AVI->video_pos < 0 || AVI->video_pos >= AVI->video_frames)
+      return -1;
+   if ((frame = avi_video_frame(AVI, AVI->video_pos)) < 0)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+   n = avi_video_index_len(AVI->video_index, frame);
+   pos = avi_video_index_pos(AVI->video_index, frame);
+   if (!AVI->ram || (pos < AVI->ram_start) || (pos + n > AVI->ram_start + AVI->ram_len))
    {
       AVI_errno = AVI_ERR_READ;
       return -1;
    }
 
+   *keyframe = avi_video_index_is_key(AVI->video_index, frame);
+   *vidbuf = AVI->ram + (pos - AVI->ram_start);
+
    AVI->video_pos++;
 
    return n;
 }
 
+/* AVI_read_frame_part: read bytes of frame starting at offset within the
+   frame, for frames that do not fit in the caller's buffer. Does not move
+   the video position. */
+
+long AVI_read_frame_part(avi_t *AVI, long frame, long offset, char *buf, long bytes)
+{
+   long n;
+
+   if (AVI->mode == AVI_MODE_WRITE)
+   {
+      AVI_errno = AVI_ERR_NOT_PERM;
+      return -1;
+   }
+   if (!AVI->video_index)
+   {
+      AVI_errno = AVI_ERR_NO_IDX;
+      return -1;
+   }
+
+   if (frame < 0 || frame >= AVI->video_frames)
+      return -1;
+   if ((frame = avi_video_frame(AVI, frame)) < 0)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+   n = avi_video_index_len(AVI->video_index, frame);
+   if (offset < 0 || offset >= n)
+      return 0;
+   if (bytes > n - offset)
+      bytes = n - offset;
+
+   if (avi_read_at(AVI, avi_video_index_pos(AVI->video_index, frame) + offset, buf, bytes) != (size_t)bytes)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+
+   return bytes;
+}
+
 int AVI_set_audio_position(avi_t *AVI, long byte)
 {
-   long n0, n1, n;
+   avi_super_index_t *si = AVI->track[AVI->aptr].audio_super;
+   long n0, n1, n, seg;
 
    if (AVI->mode == AVI_MODE_WRITE)
    {
@@ -987,10 +2356,30 @@ int AVI_set_audio_position(avi_t *AVI, long byte)
    if (byte < 0)
       byte = 0;
 
+   /* OpenDML: find and load the segment holding byte */
+
+   if (si)
+   {
+      seg = 0;
+      while (1)
+      {
+         while ((seg + 1 < si->known) && (si->entry[seg + 1].tot <= byte))
+            seg++;
+         if ((seg != si->loaded) && (avi_load_audio_segment(AVI, AVI->aptr, seg) != 0))
+         {
+            AVI_errno = AVI_ERR_READ;
+            return -1;
+         }
+         if ((seg + 1 < si->known) && (si->entry[seg + 1].tot <= byte))
+            continue;
+         break;
+      }
+   }
+
    /* Binary search in the audio chunks */
 
    n0 = 0;
-   n1 = AVI->track[AVI->aptr].audio_chunks;
+   n1 = AVI->track[AVI->aptr].audio_seg_chunks;
 
    while (n0 < n1 - 1)
    {
@@ -1007,6 +2396,33 @@ int AVI_set_audio_position(avi_t *AVI, long byte)
    return 0;
 }
 
+/* AVI_set_audio_position_aligned: AVI_set_audio_position for seeking,
+   PCM is rounded down to a whole sample frame (nBlockAlign) so the
+   channels and sample bytes stay in order, compressed audio to the start
+   of its chunk, where an MP3 frame begins. */
+
+int AVI_set_audio_position_aligned(avi_t *AVI, long byte)
+{
+   long align;
+
+   if (AVI->track[AVI->aptr].a_fmt != 1) /* not PCM */
+   {
+      if (AVI_set_audio_position(AVI, byte) != 0)
+         return -1;
+      AVI->track[AVI->aptr].audio_posb = 0;
+      return 0;
+   }
+
+   align = 0;
+   if (AVI->wave_format_ex[AVI->aptr])
+      align = AVI->wave_format_ex[AVI->aptr]->n_block_align;
+   if (align <= 0)
+      align = ((AVI->track[AVI->aptr].a_bits + 7) / 8) * AVI->track[AVI->aptr].a_chans;
+   if (align > 1)
+      byte -= byte % align;
+   return AVI_set_audio_position(AVI, byte);
+}
+
 long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
 {
    long nr, pos, left, todo;
@@ -1029,8 +2445,12 @@ long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
       left = AVI->track[AVI->aptr].audio_index[AVI->track[AVI->aptr].audio_posc].len - AVI->track[AVI->aptr].audio_posb;
       if (left == 0)
       {
-         if (AVI->track[AVI->aptr].audio_posc >= AVI->track[AVI->aptr].audio_chunks - 1)
-            return nr;
+         if (AVI->track[AVI->aptr].audio_posc >= AVI->track[AVI->aptr].audio_seg_chunks - 1)
+         {
+            if (!avi_audio_next_segment(AVI))
+               return nr;
+            continue;
+         }
          AVI->track[AVI->aptr].audio_posc++;
          AVI->track[AVI->aptr].audio_posb = 0;
          continue;
@@ -1040,8 +2460,7 @@ long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
       else
          todo = left;
       pos = AVI->track[AVI->aptr].audio_index[AVI->track[AVI->aptr].audio_posc].pos + AVI->track[AVI->aptr].audio_posb;
-      lseek(AVI->fdes, pos, SEEK_SET);
-      if (avi_read(AVI->fdes, audbuf + nr, todo) != todo)
+      if (avi_read_at(AVI, pos, audbuf + nr, todo) != (size_t)todo)
       {
          AVI_errno = AVI_ERR_READ;
          return -1;
@@ -1069,7 +2488,7 @@ long AVI_read_audio_chunk(avi_t *AVI, char *audbuf)
       return -1;
    }
 
-   if (AVI->track[AVI->aptr].audio_index[AVI->track[AVI->aptr].audio_posc].len == 0)
+   if ((AVI->track[AVI->aptr].audio_index[AVI->track[AVI->aptr].audio_posc].len == 0) && !avi_audio_next_segment(AVI))
       return 0;
    left = AVI->track[AVI->aptr].audio_index[AVI->track[AVI->aptr].audio_posc].len - AVI->track[AVI->aptr].audio_posb;
 
@@ -1080,8 +2499,7 @@ long AVI_read_audio_chunk(avi_t *AVI, char *audbuf)
       return 0;
 
    pos = AVI->track[AVI->aptr].audio_index[AVI->track[AVI->aptr].audio_posc].pos + AVI->track[AVI->aptr].audio_posb;
-   lseek(AVI->fdes, pos, SEEK_SET);
-   if (avi_read(AVI->fdes, audbuf, left) != left)
+   if (avi_read_at(AVI, pos, audbuf, left) != (size_t)left)
    {
       AVI_errno = AVI_ERR_READ;
       return -1;
@@ -1104,10 +2522,10 @@ int AVI_read_data(avi_t *AVI, char *vidbuf, long max_vidbuf,
     * Return codes:
     *
     *    1 = video data read
-    *    2 = audio data read
+    *    2 = audio data read, a chunk larger than audbuf comes in pieces
     *    0 = reached EOF
     *   -1 = video buffer too small
-    *   -2 = audio buffer too small
+    *   -2 = no audio buffer
     */
 
    off_t n;
@@ -1116,22 +2534,39 @@ int AVI_read_data(avi_t *AVI, char *vidbuf, long max_vidbuf,
    if (AVI->mode == AVI_MODE_WRITE)
       return 0;
 
+   /* the rest of an audio chunk larger than audbuf */
+
+   if (AVI->audio_left > 0)
+   {
+      n = AVI->audio_left < max_audbuf ? AVI->audio_left : max_audbuf;
+      *len = n;
+      if (avi_read_next(AVI, audbuf, n) != (size_t)n)
+         return 0;
+      AVI->audio_left -= n;
+      if (AVI->audio_left == 0 && AVI->audio_pad)
+         avi_skip(AVI, 1);
+      return 2;
+   }
+
    while (1)
    {
       /* Read tag and length */
 
-      if (avi_read(AVI->fdes, data, 8) != 8)
+      if (avi_read_next(AVI, data, 8) != 8)
          return 0;
 
-      /* if we got a list tag, ignore it */
+      /* if we got a list tag, ignore it. OpenDML continues the movi list
+         in further RIFF AVIX lists, step into them the same way */
 
-      if (strncasecmp(data, "LIST", 4) == 0)
+      if ((strncasecmp(data, "LIST", 4) == 0) || (strncasecmp(data, "RIFF", 4) == 0))
       {
-         lseek(AVI->fdes, 4, SEEK_CUR);
+         avi_skip(AVI, 4);
          continue;
       }
 
-      n = PAD_EVEN(str2ulong((unsigned char *)data + 4));
+      n = str2ulong((unsigned char *)data + 4);
+
+      /* *len is the chunk length, the pad byte is skipped */
 
       if (strncasecmp(data, AVI->video_tag, 3) == 0)
       {
@@ -1139,27 +2574,38 @@ int AVI_read_data(avi_t *AVI, char *vidbuf, long max_vidbuf,
          AVI->video_pos++;
          if (n > max_vidbuf)
          {
-            lseek(AVI->fdes, n, SEEK_CUR);
+            avi_skip(AVI, PAD_EVEN(n));
             return -1;
          }
-         if (avi_read(AVI->fdes, vidbuf, n) != n)
+         if (avi_read_next(AVI, vidbuf, n) != (size_t)n)
             return 0;
+         if (n & 1)
+            avi_skip(AVI, 1);
          return 1;
       }
       else if (strncasecmp(data, AVI->track[AVI->aptr].audio_tag, 4) == 0)
       {
-         *len = n;
-         if (n > max_audbuf)
+         if (max_audbuf <= 0)
          {
-            lseek(AVI->fdes, n, SEEK_CUR);
+            *len = n;
+            avi_skip(AVI, PAD_EVEN(n));
             return -2;
          }
-         if (avi_read(AVI->fdes, audbuf, n) != n)
+         if (n > max_audbuf)
+         {
+            AVI->audio_left = n - max_audbuf;
+            AVI->audio_pad = n & 1;
+            n = max_audbuf;
+         }
+         *len = n;
+         if (avi_read_next(AVI, audbuf, n) != (size_t)n)
             return 0;
+         if (AVI->audio_left == 0 && (n & 1))
+            avi_skip(AVI, 1);
          return 2;
          break;
       }
-      else if (lseek(AVI->fdes, n, SEEK_CUR) < 0)
+      else if (avi_skip(AVI, PAD_EVEN(n)) < 0)
          return 0;
    }
 }
@@ -7,6 +7,8 @@
 extern unsigned long total_decode_audio_ms;
 extern unsigned long total_play_audio_ms;
 
+volatile bool audio_task_hold = false; // keep the player task running past the end of the audio, e.g. while the clip plays again
+
 uint32_t i2s_curr_sample_rate = I2S_DEFAULT_SAMPLE_RATE;
 void i2s_set_sample_rate(uint32_t sample_rate)
 {
@@ -78,7 +80,7 @@ void pcm_player_task(void *pvParam)
     total_play_audio_ms += millis() - ms;
 
     vTaskDelay(pdMS_TO_TICKS(1));
-  } while (audbuf_read > 0);
+  } while ((audbuf_read > 0) || audio_task_hold);
 
   Serial.printf("pcm_player_task stop\n");
 
@@ -148,7 +150,7 @@ void mp3_player_task(void *pvParam)
     total_decode_audio_ms += millis() - ms;
 
     vTaskDelay(pdMS_TO_TICKS(1));
-  } while (audbuf_read > 0);
+  } while ((audbuf_read > 0) || audio_task_hold);
 
   Serial.printf("mp3_player_task stop\n");
   mp3.end();
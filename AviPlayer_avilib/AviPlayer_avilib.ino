@@ -179,7 +179,7 @@ void loop()
       {
         std::string s = file.name();
         // if ((!s.starts_with(".")) && (s.ends_with(".avi")))
-        if ((s.rfind(".", 0) != 0) && ((int)s.find(".avi", 0) > 0))
+        if ((s.rfind(".", 0) != 0) && (s.length() > 4) && (s.compare(s.length() - 4, 4, ".avi") == 0))
         {
           if (random(100) > 90)
           {
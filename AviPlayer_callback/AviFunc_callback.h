@@ -1,6 +1,8 @@
 #define AVI_SUPPORT_CINEPAK
 #define AVI_SUPPORT_MJPEG
 // #define AVI_SUPPORT_AUDIO // should define before include this header
+// #define AVI_INDEX_CACHE // should define before include this header
+// #define AVI_READ_AHEAD_SIZE (64 * 1024) // should define before include this header, read-ahead window in PSRAM
 
 #include "avilibRead.h"
 
@@ -51,6 +53,9 @@ unsigned long avi_start_ms, avi_next_frame_ms, avi_skip_frame_ms;
 unsigned long avi_total_read_video_ms;
 unsigned long avi_total_decode_video_ms;
 unsigned long avi_total_show_video_ms;
+unsigned long avi_video_index_lookups, avi_video_index_steps;
+long avi_index_segment_loads;
+unsigned long avi_read_ahead_hits, avi_read_ahead_misses, avi_read_ahead_fills, avi_read_ahead_bytes;
 
 #ifdef AVI_SUPPORT_AUDIO
 char *audbuf;
@@ -86,13 +91,32 @@ bool avi_init()
 bool avi_open(char *avi_filename)
 {
   Serial.printf("avi_open(%s)\n", avi_filename);
+  unsigned long open_ms = millis();
   avi = AVI_open_input_file(avi_filename, 1);
+  open_ms = millis() - open_ms;
 
   if (!avi)
   {
     Serial.printf("AVI_open_input_file %s failed!\n", avi_filename);
     return false;
   }
+  if (avi->video_super)
+  {
+    Serial.printf("AVI_open_input_file: %lu ms, OpenDML index segments: %ld\n", open_ms, avi->video_super->entries);
+  }
+  else
+  {
+    Serial.printf("AVI_open_input_file: %lu ms, idx1 entries: %ld (%0.0f entries/s)\n", open_ms, avi->n_idx, 1000.0 * avi->n_idx / max(open_ms, 1UL));
+  }
+#ifdef AVI_INDEX_CACHE
+  Serial.printf("AVI index cache: %s (%s)\n", avi->index_cache_hit ? "hit" : "miss", avi->index_cache_file);
+#endif
+#ifdef AVI_READ_AHEAD_SIZE
+  if (AVI_set_read_ahead(avi, AVI_READ_AHEAD_SIZE) != 0)
+  {
+    Serial.printf("AVI_set_read_ahead(%d) failed!\n", AVI_READ_AHEAD_SIZE);
+  }
+#endif
 
   avi_total_frames = AVI_video_frames(avi);
   avi_w = AVI_video_width(avi);
@@ -127,6 +151,8 @@ bool avi_open(char *avi_filename)
   avi_aRate = AVI_audio_rate(avi);
   avi_aBytes = AVI_audio_bytes(avi);
   avi_aChunks = AVI_audio_chunks(avi);
+  Serial.printf("Video index: %ld bytes (%0.2f bytes/frame)\n", AVI_video_index_bytes(avi), (float)AVI_video_index_bytes(avi) / avi_total_frames);
+
   Serial.printf("Audio channels: %ld, bits: %ld, format: %ld, rate: %ld, bytes: %ld, chunks: %ld\n", avi_aChans, avi_aBits, avi_aFormat, avi_aRate, avi_aBytes, avi_aChunks);
 
   avi_curr_frame = 0;
@@ -146,6 +172,38 @@ bool avi_open(char *avi_filename)
   return true;
 }
 
+#ifdef AVI_SUPPORT_MJPEG
+// JPEGDEC file callbacks, decode a frame larger than vidbuf by reading it from the AVI file piece by piece
+void avi_jpeg_close(void *pHandle)
+{
+}
+
+int32_t avi_jpeg_read(JPEGFILE *pFile, uint8_t *pBuf, int32_t iLen)
+{
+  if (iLen > (pFile->iSize - pFile->iPos))
+  {
+    iLen = pFile->iSize - pFile->iPos;
+  }
+  if (iLen <= 0)
+  {
+    return 0;
+  }
+  long r = AVI_read_frame_part((avi_t *)pFile->fHandle, avi_curr_frame, pFile->iPos, (char *)pBuf, iLen);
+  if (r <= 0)
+  {
+    return 0;
+  }
+  pFile->iPos += r;
+  return r;
+}
+
+int32_t avi_jpeg_seek(JPEGFILE *pFile, int32_t iPosition)
+{
+  pFile->iPos = iPosition;
+  return iPosition;
+}
+#endif // AVI_SUPPORT_MJPEG
+
 #ifdef AVI_SUPPORT_AUDIO
 void avi_feed_audio()
 {
@@ -176,6 +234,21 @@ bool avi_decode()
     AVI_set_video_position(avi, avi_curr_frame);
 
     long video_bytes = AVI_frame_size(avi, avi_curr_frame);
+#ifdef AVI_SUPPORT_MJPEG
+    if ((avi_vcodec == MJPEG_CODEC_CODE) && (video_bytes > estimateBufferSize))
+    {
+      unsigned long curr_ms = millis();
+      jpegdec.open(avi, video_bytes, avi_jpeg_close, avi_jpeg_read, avi_jpeg_seek, drawMCU);
+      jpegdec.setPixelType(RGB565_BIG_ENDIAN);
+      jpegdec.decode(0, 0, 0);
+      jpegdec.close();
+      avi_total_decode_video_ms += millis() - curr_ms;
+
+      ++avi_curr_frame;
+      return true;
+    }
+    else
+#endif // AVI_SUPPORT_MJPEG
     if (video_bytes > estimateBufferSize)
     {
       Serial.printf("video_bytes(%ld) > estimateBufferSize(%ld)\n", video_bytes, estimateBufferSize);
@@ -234,6 +307,20 @@ void avi_draw(int x, int y)
 
 void avi_close()
 {
+  if (avi->video_index)
+  {
+    avi_video_index_lookups = avi->video_index->lookups;
+    avi_video_index_steps = avi->video_index->steps;
+  }
+  avi_index_segment_loads = AVI_index_segment_loads(avi);
+  avi_read_ahead_hits = avi_read_ahead_misses = avi_read_ahead_fills = avi_read_ahead_bytes = 0;
+  if (avi->read_ahead)
+  {
+    avi_read_ahead_hits = avi->read_ahead->hits;
+    avi_read_ahead_misses = avi->read_ahead->misses;
+    avi_read_ahead_fills = avi->read_ahead->fills + avi->read_ahead->direct;
+    avi_read_ahead_bytes = avi->read_ahead->bytes;
+  }
   AVI_close(avi);
 #ifdef AVI_SUPPORT_AUDIO
   audbuf_read = 0;
@@ -254,6 +341,11 @@ void avi_show_stat()
   Serial.printf("Read video: %lu ms (%0.1f %%)\n", avi_total_read_video_ms, 100.0 * avi_total_read_video_ms / time_used);
   Serial.printf("Decode video: %lu ms (%0.1f %%)\n", avi_total_decode_video_ms, 100.0 * avi_total_decode_video_ms / time_used);
   Serial.printf("Show video: %lu ms (%0.1f %%)\n", avi_total_show_video_ms, 100.0 * avi_total_show_video_ms / time_used);
+  Serial.printf("Video index lookups: %lu, walked frames: %lu (%0.2f per lookup)\n", avi_video_index_lookups, avi_video_index_steps, (float)avi_video_index_steps / max(avi_video_index_lookups, 1UL));
+  Serial.printf("OpenDML index segments loaded: %ld\n", avi_index_segment_loads);
+#ifdef AVI_READ_AHEAD_SIZE
+  Serial.printf("Read-ahead hits: %lu, misses: %lu (%0.1f %% hit), file reads: %lu, %lu bytes\n", avi_read_ahead_hits, avi_read_ahead_misses, 100.0 * avi_read_ahead_hits / max(avi_read_ahead_hits + avi_read_ahead_misses, 1UL), avi_read_ahead_fills, avi_read_ahead_bytes);
+#endif
 #ifdef AVI_SUPPORT_AUDIO
   Serial.printf("Read audio: %lu ms (%0.1f %%)\n", avi_total_read_audio_ms, 100.0 * avi_total_read_audio_ms / time_used);
   Serial.printf("Decode audio: %lu ms (%0.1f %%)\n", total_decode_audio_ms, 100.0 * total_decode_audio_ms / time_used);
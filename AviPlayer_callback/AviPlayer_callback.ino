@@ -35,6 +35,9 @@ const char *avi_folder = "/avi";
 #define AVI_SUPPORT_AUDIO
 #endif
 
+// keep the decoded AVI index in a sidecar file (<filename>.idx) for faster reopen
+// #define AVI_INDEX_CACHE
+
 #include "AviFunc_callback.h"
 
 #ifdef AVI_SUPPORT_AUDIO
@@ -191,7 +194,7 @@ void loop()
       {
         std::string s = file.name();
         // if ((!s.starts_with(".")) && (s.ends_with(".avi")))
-        if ((s.rfind(".", 0) != 0) && ((int)s.find(".avi", 0) > 0))
+        if ((s.rfind(".", 0) != 0) && (s.length() > 4) && (s.compare(s.length() - 4, 4, ".avi") == 0))
         {
           if (random(100) > 90)
           {
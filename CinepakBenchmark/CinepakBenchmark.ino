@@ -0,0 +1,261 @@
+/*******************************************************************************
+ * Cinepak decoder micro benchmark
+ *
+ * Decodes synthetic frames made of each vector chunk type and prints the CPU
+ * cycles spent per 4x4 block:
+ * 0x30: every block V1 or V4
+ * 0x31: half of the blocks skipped, the others V1 or V4
+ * 0x32: every block V1
+ * The codebooks are loaded once by a first frame, the timed frames hold the
+ * vector chunk only. The codebook loading itself is timed too, in cycles per
+ * color entry. With CINEPAK_PARALLEL the same blocks are also timed in two
+ * strips, decoded on both cores, against one strip on this core only. No
+ * display or file system needed.
+ ******************************************************************************/
+#define BENCH_WIDTH 160
+#define BENCH_HEIGHT 120
+#define BENCH_LOOPS 50
+
+// #define USE_DRAW_CALLBACK // also measure keyframe band draws and inter frame span draws
+// #define CINEPAK_PARALLEL // also measure the strips decoded on both cores
+#include "cinepak.h"
+
+CinepakDecoder decoder;
+uint16_t *output_buf;
+size_t output_buf_size;
+uint8_t *frame_buf;
+size_t frame_buf_size;
+
+size_t frame_len;
+uint32_t flag_pos, flag_word, flag_mask;
+
+#ifdef USE_DRAW_CALLBACK
+void draw_callback(uint16_t x, uint16_t y, uint16_t *p, uint16_t w, uint16_t h)
+{
+}
+#endif
+
+void put8(uint8_t v)
+{
+  frame_buf[frame_len++] = v;
+}
+
+void put16(uint16_t v)
+{
+  put8(v >> 8);
+  put8(v);
+}
+
+void put24(uint32_t v)
+{
+  put8(v >> 16);
+  put16(v);
+}
+
+void set24(size_t pos, uint32_t v)
+{
+  frame_buf[pos] = v >> 16;
+  frame_buf[pos + 1] = v >> 8;
+  frame_buf[pos + 2] = v;
+}
+
+// append a flag bit, the flag words are interleaved with the block data the
+// same way the decoder reads them
+void putBit(bool b)
+{
+  if (!(flag_mask >>= 1))
+  {
+    flag_pos = frame_len;
+    flag_word = 0;
+    put16(0);
+    put16(0);
+    flag_mask = 0x80000000;
+  }
+  if (b)
+  {
+    flag_word |= flag_mask;
+    frame_buf[flag_pos] = flag_word >> 24;
+    frame_buf[flag_pos + 1] = flag_word >> 16;
+    frame_buf[flag_pos + 2] = flag_word >> 8;
+    frame_buf[flag_pos + 3] = flag_word;
+  }
+}
+
+// one strip of height rows, see buildFrame()
+void buildStrip(uint8_t chunkID, uint16_t height, long *blocks)
+{
+  size_t strip_pos = frame_len;
+  put8(0x10);
+  put24(0); // strip length
+  put16(0);
+  put16(0);
+  put16(height);
+  put16(BENCH_WIDTH);
+
+  if (!chunkID)
+  {
+    for (uint8_t id = 0x20; id <= 0x22; id += 2)
+    {
+      put8(id);
+      put24(4 + (256 * 6));
+      for (int i = 0; i < 256 * 6; i++)
+      {
+        put8(random(256));
+      }
+    }
+  }
+  else
+  {
+    size_t chunk_pos = frame_len;
+    put8(chunkID);
+    put24(0); // chunk length
+    flag_mask = 0;
+    for (long i = 0; i < (BENCH_WIDTH / 4) * (height / 4); i++)
+    {
+      if (chunkID == 0x31)
+      {
+        bool coded = random(2);
+        putBit(coded);
+        if (!coded)
+        {
+          continue;
+        }
+      }
+      bool v4 = false;
+      if (chunkID != 0x32)
+      {
+        v4 = random(2);
+        putBit(v4);
+      }
+      put8(random(256));
+      if (v4)
+      {
+        put8(random(256));
+        put8(random(256));
+        put8(random(256));
+      }
+      (*blocks)++;
+    }
+    set24(chunk_pos + 1, frame_len - chunk_pos);
+  }
+
+  set24(strip_pos + 1, frame_len - strip_pos);
+}
+
+// one frame in strips bands of equal height: a V4 and a V1 codebook chunk if chunkID is 0,
+// otherwise a vector chunk of chunkID in each strip
+size_t buildFrame(uint8_t chunkID, uint16_t strips, long *blocks)
+{
+  frame_len = 0;
+  put8(0);
+  put24(0); // frame length
+  put16(BENCH_WIDTH);
+  put16(BENCH_HEIGHT);
+  put16(strips);
+
+  *blocks = 0;
+  for (uint16_t s = 0; s < strips; s++)
+  {
+    buildStrip(chunkID, BENCH_HEIGHT / strips, blocks);
+  }
+
+  set24(1, frame_len);
+  return frame_len;
+}
+
+void decode(size_t len, bool iskeyframe)
+{
+#ifdef USE_DRAW_CALLBACK
+  decoder.decodeFrame(frame_buf, len, output_buf, output_buf_size, draw_callback, iskeyframe);
+#else
+  decoder.decodeFrame(frame_buf, len, output_buf, output_buf_size);
+#endif
+}
+
+float benchFrame(size_t len, bool iskeyframe)
+{
+  uint32_t s = ESP.getCycleCount();
+  for (int i = 0; i < BENCH_LOOPS; i++)
+  {
+    decode(len, iskeyframe);
+  }
+  return (float)(ESP.getCycleCount() - s) / BENCH_LOOPS;
+}
+
+void benchCodebooks()
+{
+  long blocks;
+  float cycles = benchFrame(buildFrame(0, 1, &blocks), true);
+  Serial.printf("codebooks: 512 entries, %0.1f cycles/entry\n", cycles / 512);
+}
+
+void bench(uint8_t chunkID, bool iskeyframe)
+{
+  long blocks;
+  float cycles = benchFrame(buildFrame(chunkID, 1, &blocks), iskeyframe);
+  long all_blocks = (BENCH_WIDTH / 4) * (BENCH_HEIGHT / 4);
+  Serial.printf("chunk 0x%02x%s: %ld coded blocks, %0.1f cycles/block, %0.1f cycles/coded block\n",
+                chunkID,
+#ifdef USE_DRAW_CALLBACK
+                iskeyframe ? " keyframe" : " inter frame",
+#else
+                "",
+#endif
+                blocks, cycles / all_blocks, cycles / max(blocks, 1L));
+}
+
+#ifdef CINEPAK_PARALLEL
+// a single strip is decoded on this core only, two strips on both cores
+void benchParallel(uint8_t chunkID)
+{
+  long blocks;
+  float one = benchFrame(buildFrame(chunkID, 1, &blocks), true);
+  float two = benchFrame(buildFrame(chunkID, 2, &blocks), true);
+  Serial.printf("chunk 0x%02x: 1 strip %0.0f cycles/frame, 2 strips on both cores %0.0f cycles/frame (x%0.2f)\n", chunkID, one, two, one / two);
+}
+#endif
+
+void setup()
+{
+  Serial.begin(115200);
+  // Serial.setDebugOutput(true);
+  // while(!Serial);
+  Serial.println("CinepakBenchmark");
+
+#ifdef USE_DRAW_CALLBACK
+  output_buf_size = BENCH_WIDTH * 4 * 2;
+#else
+  output_buf_size = BENCH_WIDTH * BENCH_HEIGHT * 2;
+#endif
+  output_buf = (uint16_t *)heap_caps_aligned_alloc(16, output_buf_size, MALLOC_CAP_8BIT);
+  frame_buf_size = 64 + (2 * (4 + (256 * 6))) + ((BENCH_WIDTH / 4) * (BENCH_HEIGHT / 4) * 5);
+  frame_buf = (uint8_t *)heap_caps_malloc(frame_buf_size, MALLOC_CAP_8BIT);
+  if ((!output_buf) || (!frame_buf))
+  {
+    Serial.println("buffer malloc failed!");
+    return;
+  }
+
+  randomSeed(1);
+  Serial.printf("%d x %d, %d loops, CPU %lu MHz\n", BENCH_WIDTH, BENCH_HEIGHT, BENCH_LOOPS, (unsigned long)getCpuFrequencyMhz());
+  benchCodebooks(); // also leaves the codebooks loaded
+  for (uint8_t chunkID = 0x30; chunkID <= 0x32; chunkID++)
+  {
+    bench(chunkID, true);
+#ifdef USE_DRAW_CALLBACK
+    bench(chunkID, false);
+#endif
+  }
+#ifdef CINEPAK_PARALLEL
+  for (uint8_t chunkID = 0x30; chunkID <= 0x32; chunkID++)
+  {
+    benchParallel(chunkID);
+  }
+  Serial.printf("worker stack: %lu bytes never used\n", (unsigned long)decoder.getWorkerStackFree());
+#endif
+}
+
+void loop()
+{
+  delay(1000);
+}